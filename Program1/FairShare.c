@@ -0,0 +1,250 @@
+/*
+* FairShare.c - Proportional share scheduler keyed on virtual runtime
+* Author: Kyle Jennings
+*
+* Each thread is charged the TSC cycles it ran, scaled by
+* LWP_WEIGHT_DEFAULT / weight, and the thread with the least virtual
+* runtime runs next. Waiting threads sit in a pairing heap; the running
+* thread is held outside it until next() charges it and puts it back.
+*/
+
+#include <stdlib.h>
+#include <x86intrin.h>
+#include "lwp.h"
+#include "schedulers.h"
+
+static void f_admit(thread new);
+static void f_remove(thread victim);
+static thread f_next(void);
+static void f_handoff(thread t);
+static void f_register(void);
+static void charge(unsigned long now);
+static thread meld(thread a, thread b);
+static thread merge_pairs(thread first);
+
+static struct scheduler publish = {NULL, NULL, f_admit, f_remove, f_next};
+scheduler FairShare = &publish;
+
+/* pairing heap links. prev is the left sibling, or the parent for a first
+   child, and NULL only for the root */
+#define child   sched_one
+#define sibling sched_two
+#define prev    sched_three
+
+#define VR_BEFORE(a, b)  ((long) ((a) - (b)) < 0)
+
+/* per kernel thread, so each worker of the multi-worker runtime gets its
+   own heap */
+static __thread thread root;                /* waiting thread with least vr */
+static __thread thread current;             /* last thread next() returned  */
+static __thread unsigned long last_tsc;     /* when current was picked      */
+static __thread unsigned long min_vruntime; /* never moves backwards        */
+
+/**
+ * @brief Adds a thread to the heap. A thread's virtual runtime is raised to
+ *  the current minimum first, so new (or long-gone) threads don't get to
+ *  run for as long as they were away.
+ *
+ * @param new the thread to add
+ */
+static void f_admit(thread new)
+{
+    if(VR_BEFORE(new->vruntime, min_vruntime))
+        new->vruntime = min_vruntime;
+
+    new->child = NULL;
+    new->sibling = NULL;
+    new->prev = NULL;
+    root = meld(root, new);
+}
+
+/**
+ * @brief Takes a thread out of the scheduler, whether it is the running
+ *  thread or anywhere in the heap
+ *
+ * @param victim the thread to remove
+ */
+static void f_remove(thread victim)
+{
+    thread sub;
+
+    if(victim == current)
+    {
+        current = NULL;
+        return;
+    }
+
+    if(victim == root)
+        root = merge_pairs(root->child);
+    else if(victim->prev)
+    {
+        /* cut the subtree loose from its parent or left sibling */
+        if(victim->prev->child == victim)
+            victim->prev->child = victim->sibling;
+        else
+            victim->prev->sibling = victim->sibling;
+        if(victim->sibling)
+            victim->sibling->prev = victim->prev;
+
+        sub = merge_pairs(victim->child);
+        root = meld(root, sub);
+    }
+    else
+        return;     /* not queued */
+
+    victim->child = NULL;
+    victim->sibling = NULL;
+    victim->prev = NULL;
+}
+
+/**
+ * @brief Charges the running thread for the cycles since it was picked,
+ *  puts it back in the heap and picks the thread with the least virtual
+ *  runtime
+ *
+ * @return thread the next thread or NO_THREAD if there are none
+ */
+static thread f_next(void)
+{
+    unsigned long now = __rdtsc();
+    thread res;
+
+    charge(now);
+    if( (res = root) )
+    {
+        root = merge_pairs(res->child);
+        res->child = NULL;
+        if(VR_BEFORE(min_vruntime, res->vruntime))
+            min_vruntime = res->vruntime;
+    }
+
+    current = res;
+    last_tsc = now;
+    return res;
+}
+
+/**
+ * @brief Registers f_handoff() before main() runs, in any program that
+ *  links FairShare in
+ */
+static void __attribute__ ((constructor)) f_register(void)
+{
+    lwp_set_handoff_hook(FairShare, f_handoff);
+}
+
+/**
+ * @brief Makes t the running thread as if next() had picked it, for
+ *  lwp_yield_to() and channel handoffs. Without this the thread that
+ *  handed off would be charged for the time t runs.
+ *
+ * @param t the thread that runs next
+ */
+static void f_handoff(thread t)
+{
+    unsigned long now = __rdtsc();
+
+    charge(now);
+    f_remove(t);
+    if(VR_BEFORE(min_vruntime, t->vruntime))
+        min_vruntime = t->vruntime;
+
+    current = t;
+    last_tsc = now;
+}
+
+/**
+ * @brief Charges the running thread for the cycles since it was picked and
+ *  puts it back in the heap
+ *
+ * @param now the TSC reading to charge up to
+ */
+static void charge(unsigned long now)
+{
+    unsigned int weight;
+
+    if(!current)
+        return;
+
+    weight = current->weight ? current->weight : 1;
+    current->vruntime += (now - last_tsc) * LWP_WEIGHT_DEFAULT / weight;
+    current->child = NULL;
+    current->sibling = NULL;
+    current->prev = NULL;
+    root = meld(root, current);
+    current = NULL;
+}
+
+/**
+ * @brief Melds two heaps: the root with the larger virtual runtime becomes
+ *  the first child of the other
+ *
+ * @param a root of one heap, or NULL
+ * @param b root of the other, or NULL
+ * @return thread root of the result
+ */
+static thread meld(thread a, thread b)
+{
+    thread t;
+
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+    if(VR_BEFORE(b->vruntime, a->vruntime))
+    {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    b->prev = a;
+    b->sibling = a->child;
+    if(a->child)
+        a->child->prev = b;
+    a->child = b;
+    a->sibling = NULL;
+    a->prev = NULL;
+    return a;
+}
+
+/**
+ * @brief Two pass merge of a sibling list into one heap: meld neighbours
+ *  left to right, then meld the results right to left
+ *
+ * @param first leftmost sibling, or NULL
+ * @return thread root of the merged heap
+ */
+static thread merge_pairs(thread first)
+{
+    thread a, b, rest, pairs = NULL;
+
+    /* first pass; the melded pairs are stacked through sibling */
+    while(first)
+    {
+        a = first;
+        b = a->sibling;
+        rest = b ? b->sibling : NULL;
+        a->prev = NULL;
+        if(b)
+            b->prev = NULL;
+        a->sibling = NULL;
+        if(b)
+            b->sibling = NULL;
+
+        a = meld(a, b);
+        a->sibling = pairs;
+        pairs = a;
+        first = rest;
+    }
+
+    /* second pass */
+    first = NULL;
+    while(pairs)
+    {
+        a = pairs;
+        pairs = a->sibling;
+        a->sibling = NULL;
+        first = meld(first, a);
+    }
+    return first;
+}
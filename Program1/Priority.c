@@ -0,0 +1,110 @@
+/*
+* Priority.c - Fixed priority scheduler with constant time selection
+* Author: Kyle Jennings
+*
+* Every priority level has its own round-robin ring, and a bitmap records
+* which levels have threads, so next() is a count-trailing-zeros and a
+* pointer bump no matter how many threads there are. Level 0 is the most
+* urgent. A level only runs when every level above it is empty.
+*/
+
+#include <stdlib.h>
+#include "lwp.h"
+#include "schedulers.h"
+
+static void p_admit(thread new);
+static void p_remove(thread victim);
+static thread p_next(void);
+
+static struct scheduler publish = {NULL, NULL, p_admit, p_remove, p_next};
+scheduler Priority = &publish;
+
+#define tnext sched_one
+#define tprev sched_two
+
+/* per kernel thread, so each worker of the multi-worker runtime gets its
+   own run queues */
+static __thread thread levels[LWP_PRIO_LEVELS];  /* head of each ring     */
+static __thread unsigned long long ready;        /* bit n: levels[n] used */
+
+/**
+ * @brief Adds a thread to the back of its priority level's ring
+ *
+ * @param new the thread to add
+ */
+static void p_admit(thread new)
+{
+    unsigned int prio = new->priority;
+    thread head;
+
+    if(prio >= LWP_PRIO_LEVELS)
+        prio = LWP_PRIO_LEVELS - 1;
+
+    if( (head = levels[prio]) )
+    {
+        new->tnext = head;
+        new->tprev = head->tprev;
+        new->tprev->tnext = new;
+        head->tprev = new;
+    }
+    else
+    {
+        levels[prio] = new;
+        new->tnext = new;
+        new->tprev = new;
+        ready |= 1ULL << prio;
+    }
+}
+
+/**
+ * @brief Cuts a thread out of its level's ring. The thread's priority must
+ *  not have changed since it was admitted, which lwp_set_priority() sees to.
+ *
+ * @param victim the thread to remove
+ */
+static void p_remove(thread victim)
+{
+    unsigned int prio = victim->priority;
+
+    /* threads that aren't queued have NULL links */
+    if(!victim->tnext)
+        return;
+    if(prio >= LWP_PRIO_LEVELS)
+        prio = LWP_PRIO_LEVELS - 1;
+
+    if(victim->tnext == victim)
+    {
+        levels[prio] = NULL;
+        ready &= ~(1ULL << prio);
+    }
+    else
+    {
+        victim->tprev->tnext = victim->tnext;
+        victim->tnext->tprev = victim->tprev;
+        if(levels[prio] == victim)
+            levels[prio] = victim->tnext;
+    }
+
+    victim->tnext = NULL;
+    victim->tprev = NULL;
+}
+
+/**
+ * @brief Picks the head of the most urgent non-empty level and rotates that
+ *  level, so threads of equal priority take turns
+ *
+ * @return thread the next thread or NO_THREAD if there are none
+ */
+static thread p_next(void)
+{
+    unsigned int prio;
+    thread res;
+
+    if(!ready)
+        return NO_THREAD;
+
+    prio = __builtin_ctzll(ready);
+    res = levels[prio];
+    levels[prio] = res->tnext;
+    return res;
+}
@@ -0,0 +1,69 @@
+/*
+ * bench_closure.cpp - Spawning a capturing lambda with lwp::spawn(),
+ * against lwp_create() on a heap-boxed copy of it.
+ * Author: Kyle Jennings
+ *
+ * Output is CSV in the bench_suite format: bench,variant,threads,ops,value,unit
+ */
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include "lwp.hpp"
+
+#define SPAWNS      100000
+#define SMALLSTACK  2048        /* words */
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the C way: box the captures and unbox them in a trampoline */
+struct boxed {
+    std::string name;
+    long        n;
+};
+
+static int boxed_main(void *arg)
+{
+    boxed *b = static_cast<boxed *>(arg);
+    int r = static_cast<int>(b->name.size() + b->n);
+
+    delete b;
+    return r;
+}
+
+int main()
+{
+    std::string name = "closure";
+    double start;
+    long sum = 0, i;
+    int status;
+
+    lwp_start();
+    printf("bench,variant,threads,ops,value,unit\n");
+
+    start = now_ns();
+    for(i = 0; i < SPAWNS; i++)
+    {
+        tid_t tid = lwp_create(boxed_main, new boxed{name, i}, SMALLSTACK);
+        lwp_join(tid, &status);
+        sum += LWPTERMSTAT(status);
+    }
+    printf("closure,boxed,1,%d,%.2f,ns_per_spawn\n", SPAWNS,
+           (now_ns() - start) / SPAWNS);
+
+    start = now_ns();
+    for(i = 0; i < SPAWNS; i++)
+        sum += lwp::spawn([name, i] {
+            return static_cast<int>(name.size() + i);
+        }, SMALLSTACK).join();
+    printf("closure,inplace,1,%d,%.2f,ns_per_spawn\n", SPAWNS,
+           (now_ns() - start) / SPAWNS);
+
+    lwp_exit(sum == 0);
+}
@@ -0,0 +1,112 @@
+/*
+ * bench_coro.cpp - lwp::task coroutines run as stackless LWPs: frame
+ * size, the cost of lwp::go() and join() against lwp::spawn() on a stack,
+ * and how much memory a million of them waiting at once take.
+ * Author: Kyle Jennings
+ *
+ * Output is CSV in the bench_suite format: bench,variant,threads,ops,value,unit
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <vector>
+#include <sys/resource.h>
+#include "lwp.hpp"
+
+#define SPAWNS      100000
+#define PENDING     1000000
+#define SMALLSTACK  2048        /* words */
+
+/* every coroutine frame comes through here, so the last size is the
+   size of the last frame made */
+static std::size_t last_alloc;
+
+void *operator new(std::size_t n)
+{
+    void *p = std::malloc(n ? n : 1);
+
+    if(!p)
+        throw std::bad_alloc();
+    last_alloc = n;
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long maxrss_kb()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static lwp::task<int> leaf(int i)
+{
+    co_await lwp::reschedule();
+    co_return i;
+}
+
+int main()
+{
+    std::vector<lwp::join_handle<int>> waiting;
+    double start;
+    long sum = 0, rss, i;
+
+    lwp_start();
+    printf("bench,variant,threads,ops,value,unit\n");
+
+    {
+        auto t = leaf(0);
+
+        printf("coro,frame,1,1,%zu,bytes\n", last_alloc);
+    }
+
+    start = now_ns();
+    for(i = 0; i < SPAWNS; i++)
+        sum += lwp::spawn([i] {
+            lwp::yield();
+            return static_cast<int>(i);
+        }, SMALLSTACK).join();
+    printf("coro,spawn_stack,1,%d,%.2f,ns_per_task\n", SPAWNS,
+           (now_ns() - start) / SPAWNS);
+
+    start = now_ns();
+    for(i = 0; i < SPAWNS; i++)
+        sum += lwp::go(leaf(i)).join();
+    printf("coro,go,1,%d,%.2f,ns_per_task\n", SPAWNS,
+           (now_ns() - start) / SPAWNS);
+
+    /* all of them waiting in the run queue at once */
+    waiting.reserve(PENDING);
+    rss = maxrss_kb();
+    start = now_ns();
+    for(i = 0; i < PENDING; i++)
+        waiting.push_back(lwp::go(leaf(i)));
+    printf("coro,pending_bytes,1,%d,%.0f,bytes_per_task\n", PENDING,
+           (maxrss_kb() - rss) * 1024.0 / PENDING);
+    for(auto &h : waiting)
+        sum += h.join();
+    printf("coro,pending,1,%d,%.2f,ns_per_task\n", PENDING,
+           (now_ns() - start) / PENDING);
+
+    lwp_exit(sum == 0);
+}
@@ -0,0 +1,243 @@
+/*
+ * bench_spawn.c - Measures lwp_spawn()/lwp_sync() on recursive fib and
+ * quicksort, against the plain serial recursion, with a growing number
+ * of workers.
+ * Author: Kyle Jennings
+ *
+ * Every run happens in a child process, since the library can only be
+ * started once. Workers 0 is the serial version, without the library.
+ * Output is CSV: bench,workers,ms,speedup
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "lwp.h"
+
+#define FIBN        27
+#define QSIZE       (1 << 22)   /* ints to sort */
+#define QCUTOFF     4096        /* sort smaller pieces serially */
+#define MAXWORKERS  4
+
+typedef struct span {
+    int  *a;
+    long n;
+} span;
+
+static double run(int bench, unsigned int n);
+static int fib(int n);
+static int fib_task(void *arg);
+static void qsort_serial(int *a, long n);
+static int qsort_task(void *arg);
+static long partition(int *a, long n);
+
+static const char *names[] = {"fib", "quicksort"};
+static int *data;
+
+int main(void)
+{
+    unsigned int n;
+    double ms, base = 0;
+    int b, fds[2];
+    pid_t pid;
+
+    printf("bench,workers,ms,speedup\n");
+    fflush(stdout);
+    for(b = 0; b < 2; b++)
+    {
+        for(n = 0; n <= MAXWORKERS; n = n ? n * 2 : 1)
+        {
+            if(pipe(fds) < 0 || (pid = fork()) < 0)
+            {
+                perror("bench_spawn");
+                return 1;
+            }
+            if(pid == 0)
+            {
+                close(fds[0]);
+                ms = run(b, n);
+                if(write(fds[1], &ms, sizeof(ms)) != sizeof(ms))
+                    _exit(1);
+                _exit(0);
+            }
+
+            close(fds[1]);
+            if(read(fds[0], &ms, sizeof(ms)) != sizeof(ms) || ms < 0)
+            {
+                fprintf(stderr, "%s with %u workers failed\n", names[b], n);
+                return 1;
+            }
+            close(fds[0]);
+            waitpid(pid, NULL, 0);
+
+            if(n == 0)
+                base = ms;
+            printf("%s,%u,%.1f,%.2f\n", names[b], n, ms, base / ms);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs one benchmark, serially for n == 0 and with spawns on n
+ *  workers otherwise, and checks the answer
+ *
+ * @param bench 0 for fib, 1 for quicksort
+ * @param n number of workers
+ * @return double wall time in milliseconds, or -1 if the answer is wrong
+ */
+static double run(int bench, unsigned int n)
+{
+    struct timespec start, end;
+    lwp_task task;
+    span all;
+    long i;
+    int ok = TRUE;
+
+    if(bench == 1)
+    {
+        if( !(data = malloc(QSIZE * sizeof(int))) )
+            return -1;
+        srandom(1);
+        for(i = 0; i < QSIZE; i++)
+            data[i] = random();
+    }
+    if(n)
+    {
+        if(lwp_set_workers(n) < 0)
+            return -1;
+        lwp_start();
+    }
+
+    all.a = data;
+    all.n = QSIZE;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(bench == 0)
+    {
+        if(n)
+        {
+            lwp_spawn(&task, fib_task, (void *) FIBN);
+            lwp_sync();
+            ok = task.result == 196418;
+        }
+        else
+            ok = fib(FIBN) == 196418;
+    }
+    else
+    {
+        if(n)
+        {
+            lwp_spawn(&task, qsort_task, &all);
+            lwp_sync();
+        }
+        else
+            qsort_serial(data, QSIZE);
+        for(i = 1; i < QSIZE; i++)
+            ok &= data[i - 1] <= data[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(!ok)
+        return -1;
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static int fib(int n)
+{
+    if(n < 2)
+        return n;
+    return fib(n - 1) + fib(n - 2);
+}
+
+/* no cutoff, so this is mostly spawn overhead */
+static int fib_task(void *arg)
+{
+    long n = (long) arg;
+    lwp_task child;
+    int x;
+
+    if(n < 2)
+        return n;
+    lwp_spawn(&child, fib_task, (void *) (n - 1));
+    x = fib_task((void *) (n - 2));
+    lwp_sync();
+    return child.result + x;
+}
+
+static void qsort_serial(int *a, long n)
+{
+    long p;
+
+    while(n > 1)
+    {
+        p = partition(a, n);
+        qsort_serial(a, p);
+        a += p + 1;
+        n -= p + 1;
+    }
+}
+
+static int qsort_task(void *arg)
+{
+    span *s = arg, left, right;
+    lwp_task child;
+    long p;
+
+    if(s->n <= QCUTOFF)
+    {
+        qsort_serial(s->a, s->n);
+        return 0;
+    }
+
+    p = partition(s->a, s->n);
+    left.a = s->a;
+    left.n = p;
+    right.a = s->a + p + 1;
+    right.n = s->n - p - 1;
+    lwp_spawn(&child, qsort_task, &left);
+    qsort_task(&right);
+    lwp_sync();
+    return 0;
+}
+
+/**
+ * @brief Lomuto partition around the median of the first, middle and last
+ *  elements
+ *
+ * @param a the elements
+ * @param n how many, at least 2
+ * @return long where the pivot ended up
+ */
+static long partition(int *a, long n)
+{
+    long i, j, m = n / 2;
+    int t, pivot;
+
+    if(a[m] < a[0])
+    {
+        t = a[m]; a[m] = a[0]; a[0] = t;
+    }
+    if(a[n - 1] < a[0])
+    {
+        t = a[n - 1]; a[n - 1] = a[0]; a[0] = t;
+    }
+    if(a[m] < a[n - 1])
+    {
+        t = a[m]; a[m] = a[n - 1]; a[n - 1] = t;
+    }
+
+    pivot = a[n - 1];
+    for(i = 0, j = 0; j < n - 1; j++)
+    {
+        if(a[j] < pivot)
+        {
+            t = a[i]; a[i] = a[j]; a[j] = t;
+            i++;
+        }
+    }
+    t = a[i]; a[i] = a[n - 1]; a[n - 1] = t;
+    return i;
+}
@@ -0,0 +1,659 @@
+/*
+ * bench_suite.c - Microbenchmarks for liblwp, run by `make bench`
+ * Author: Kyle Jennings
+ *
+ * Every result is one CSV row: bench,variant,threads,ops,value,unit
+ * Timings are the median of REPEAT runs, so rows from two builds can be
+ * diffed to spot regressions.
+ *
+ *   mem     resident and virtual memory per idle thread
+ *   yield   ping-pong between two threads, lean and full FPU switches, and
+ *           lean with the event trace recording
+ *   handoff ping-pong with runnable bystanders, through the scheduler and
+ *           with lwp_yield_to()
+ *   churn   create/exit/wait cycles with a batch of threads in flight
+ *   tid     tid2thread() on random live tids
+ *   sched   a scheduler's next() with threads queued, on fake contexts
+ *   sync    uncontended mutex lock/unlock, and semaphore ping-pongs with
+ *           and without a timeout (which arms and cancels a timer each time)
+ *   chan    messages streamed through unbuffered and buffered channels
+ *   io      a byte bounced between two threads over a pair of pipes
+ *   key     lwp_getspecific() on a key stored inline and on an overflow key
+ *   pool    trivial tasks in batches, each on its own LWP and on a pool
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "lwp.h"
+#include "schedulers.h"
+
+#define REPEAT      5
+#define MEMTHREADS  1000
+#define YIELDS      1000000
+#define HANDOFFS    100000
+#define BYSTANDERS  100
+#define CHURNOPS    100000
+#define MAXTID      100000
+#define LOOKUPS     10000000
+#define MAXSCHED    1000000
+#define NEXTS       1000000
+#define SMALLSTACK  2048        /* words */
+#define SYNCOPS     1000000
+#define CHANMSGS    1000000
+#define CHANCAP     64
+#define IOTRIPS     100000
+#define KEYGETS     10000000
+#define POOLTASKS   100000
+#define POOLBATCH   64
+#define POOLWORKERS 4
+
+static void bench_mem(void);
+static void bench_yield(void);
+static void bench_handoff(void);
+static void bench_churn(void);
+static void bench_tid(void);
+static void bench_sched(void);
+static void bench_sync(void);
+static void bench_chan(void);
+static void bench_io(void);
+static void bench_key(void);
+static void bench_pool(void);
+static void row(const char *bench, const char *variant, unsigned long threads,
+    unsigned long ops, double value, const char *unit);
+static double median(double *v, int n);
+static double now_ns(void);
+static int statm(unsigned long *size, unsigned long *resident);
+static int partner(void *arg);
+static int handoff_partner(void *arg);
+static int bystander(void *arg);
+static int sem_partner(void *arg);
+static int sem_timed_partner(void *arg);
+static int chan_sink(void *arg);
+static int io_echo(void *arg);
+static int idle(void *arg);
+
+static tid_t tids[MAXTID];
+static volatile int stop;
+static int pipes[2][2];
+static lwp_sem ping = LWP_SEM_INITIALIZER(0);
+static lwp_sem pong = LWP_SEM_INITIALIZER(0);
+
+int main(void)
+{
+    printf("bench,variant,threads,ops,value,unit\n");
+
+    /* everything runs on the original thread as an LWP. Memory goes
+       first, while the stack pool is still empty */
+    lwp_start();
+    bench_mem();
+    bench_yield();
+    bench_handoff();
+    bench_churn();
+    bench_tid();
+    bench_sched();
+    bench_sync();
+    bench_chan();
+    bench_io();
+    bench_key();
+    bench_pool();
+
+    lwp_exit(0);
+    return 0;
+}
+
+/**
+ * @brief Resident and virtual memory added per thread that has been
+ *  created but never run, with the default and with a small stack
+ */
+static void bench_mem(void)
+{
+    static const size_t lens[] = {0, SMALLSTACK};
+    static const char *names[] = {"default_stack", "small_stack"};
+    unsigned long size0, res0, size1, res1;
+    long page = sysconf(_SC_PAGE_SIZE);
+    int i, s;
+
+    for(s = 0; s < 2; s++)
+    {
+        if(statm(&size0, &res0) < 0)
+            return;
+        for(i = 0; i < MEMTHREADS; i++)
+            tids[i] = lwp_create(idle, NULL, lens[s]);
+        if(statm(&size1, &res1) < 0)
+            return;
+
+        row("mem", names[s], MEMTHREADS, MEMTHREADS,
+            (double) (res1 - res0) * page / MEMTHREADS, "bytes_resident");
+        row("mem", names[s], MEMTHREADS, MEMTHREADS,
+            (double) (size1 - size0) * page / MEMTHREADS, "bytes_virtual");
+
+        for(i = 0; i < MEMTHREADS; i++)
+            lwp_wait(NULL);
+    }
+}
+
+/**
+ * @brief Ping-pong between this thread and a partner. Each of our yields is
+ *  a switch there and a switch back.
+ */
+static void bench_yield(void)
+{
+    static const char *names[] = {"lean", "fpu", "traced"};
+    double runs[REPEAT], start;
+    tid_t other;
+    int p, r, i;
+
+    for(p = 0; p < 3; p++)
+    {
+        for(r = 0; r < REPEAT; r++)
+        {
+            other = lwp_create(partner, NULL, 0);
+            lwp_set_fpu(other, p == 1);
+            lwp_set_fpu(lwp_gettid(), p == 1);
+            if(p == 2)
+                lwp_trace_start(0);
+
+            start = now_ns();
+            for(i = 0; i < YIELDS; i++)
+                lwp_yield();
+            runs[r] = (now_ns() - start) / (2 * YIELDS);
+            lwp_trace_stop();
+            lwp_wait(NULL);
+        }
+        row("yield", names[p], 2, 2 * YIELDS, median(runs, REPEAT), "ns_per_switch");
+    }
+    lwp_set_fpu(lwp_gettid(), FALSE);
+}
+
+/**
+ * @brief Ping-pong between this thread and a partner with BYSTANDERS other
+ *  threads runnable. lwp_yield() goes round all of them on every handoff;
+ *  lwp_yield_to() goes straight to the partner.
+ */
+static void bench_handoff(void)
+{
+    static const char *names[] = {"yield", "yield_to"};
+    double runs[REPEAT], start;
+    tid_t self = lwp_gettid(), other;
+    int d, r, i;
+
+    for(d = 0; d < 2; d++)
+    {
+        for(r = 0; r < REPEAT; r++)
+        {
+            stop = FALSE;
+            for(i = 0; i < BYSTANDERS; i++)
+                lwp_create(bystander, NULL, SMALLSTACK);
+            other = lwp_create(handoff_partner, d ? (void *) self : NULL,
+                               SMALLSTACK);
+
+            start = now_ns();
+            for(i = 0; i < HANDOFFS; i++)
+            {
+                if(d)
+                    lwp_yield_to(other);
+                else
+                    lwp_yield();
+            }
+            runs[r] = (now_ns() - start) / (2 * HANDOFFS);
+
+            stop = TRUE;
+            for(i = 0; i < BYSTANDERS + 1; i++)
+                lwp_wait(NULL);
+        }
+        row("handoff", names[d], BYSTANDERS + 2, 2 * HANDOFFS,
+            median(runs, REPEAT), "ns_per_handoff");
+    }
+}
+
+/**
+ * @brief Create/exit/wait cycles. With a batch of b, b threads are created
+ *  and then all waited for, so b threads are in flight at once.
+ */
+static void bench_churn(void)
+{
+    static const int batches[] = {1, 64, 4096};
+    double runs[REPEAT], start;
+    int b, r, i, j;
+
+    for(b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+    {
+        for(r = 0; r < REPEAT; r++)
+        {
+            start = now_ns();
+            for(i = 0; i < CHURNOPS; i += batches[b])
+            {
+                for(j = 0; j < batches[b]; j++)
+                    lwp_create(idle, NULL, SMALLSTACK);
+                for(j = 0; j < batches[b]; j++)
+                    lwp_wait(NULL);
+            }
+            runs[r] = (now_ns() - start) / i;
+        }
+        row("churn", "small_stack", batches[b], CHURNOPS, median(runs, REPEAT),
+            "ns_per_cycle");
+    }
+}
+
+/**
+ * @brief tid2thread() on random live tids as the thread count grows
+ */
+static void bench_tid(void)
+{
+    double runs[REPEAT], start;
+    unsigned long x = 88172645463325252UL;
+    unsigned long found;
+    int n, m = 0, r, i;
+
+    /* every guard page is its own mapping, and this many of them would
+       run past vm.max_map_count */
+    lwp_set_stackguard(FALSE);
+
+    for(n = 10; n <= MAXTID; n *= 10)
+    {
+        for(; m < n; m++)
+            tids[m] = lwp_create(idle, NULL, SMALLSTACK);
+
+        /* xorshift keeps picking a tid cheap */
+        for(r = 0; r < REPEAT; r++)
+        {
+            found = 0;
+            start = now_ns();
+            for(i = 0; i < LOOKUPS; i++)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                found += tid2thread(tids[x % n]) != NULL;
+            }
+            runs[r] = (now_ns() - start) / LOOKUPS;
+            if(found != LOOKUPS)
+                fprintf(stderr, "bench_suite: %lu lookups failed\n", LOOKUPS - found);
+        }
+        row("tid", "random", n, LOOKUPS, median(runs, REPEAT), "ns_per_lookup");
+    }
+
+    for(i = 0; i < m; i++)
+        lwp_wait(NULL);
+    lwp_set_stackguard(TRUE);
+}
+
+/**
+ * @brief A scheduler's next() with n threads queued. The threads are bare
+ *  contexts that are never switched to, so a million of them is cheap.
+ *  Round robin is run in place (we are queued there ourselves, and we
+ *  don't yield until the fakes are gone); the others are driven directly.
+ */
+static void bench_sched(void)
+{
+    scheduler scheds[] = {lwp_get_scheduler(), Priority, FairShare};
+    static const char *names[] = {"round_robin", "priority", "fair_share"};
+    double runs[REPEAT], start;
+    context *fake;
+    int s, n, r, i;
+
+    for(s = 0; s < 3; s++)
+    {
+        for(n = 10; n <= MAXSCHED; n *= 10)
+        {
+            if( !(fake = calloc(n, sizeof(context))) )
+            {
+                perror("bench_suite");
+                return;
+            }
+            for(i = 0; i < n; i++)
+            {
+                fake[i].priority = LWP_PRIO_DEFAULT;
+                fake[i].weight = LWP_WEIGHT_DEFAULT;
+                scheds[s]->admit(&fake[i]);
+            }
+
+            scheds[s]->next();      /* first pick may do a one-off merge */
+            for(r = 0; r < REPEAT; r++)
+            {
+                start = now_ns();
+                for(i = 0; i < NEXTS; i++)
+                    scheds[s]->next();
+                runs[r] = (now_ns() - start) / NEXTS;
+            }
+            row("sched", names[s], n, NEXTS, median(runs, REPEAT), "ns_per_next");
+
+            for(i = 0; i < n; i++)
+                scheds[s]->remove(&fake[i]);
+            free(fake);
+        }
+    }
+}
+
+/**
+ * @brief Lock/unlock of a mutex nobody else wants, which never leaves the
+ *  fast path, and a ping-pong where each side parks on a semaphore until
+ *  the other posts it
+ */
+static void bench_sync(void)
+{
+    lwp_mutex m = LWP_MUTEX_INITIALIZER;
+    double runs[REPEAT], start;
+    int r, i;
+
+    for(r = 0; r < REPEAT; r++)
+    {
+        start = now_ns();
+        for(i = 0; i < SYNCOPS; i++)
+        {
+            lwp_mutex_lock(&m);
+            lwp_mutex_unlock(&m);
+        }
+        runs[r] = (now_ns() - start) / SYNCOPS;
+    }
+    row("sync", "mutex_uncontended", 1, SYNCOPS, median(runs, REPEAT), "ns_per_lock");
+
+    for(r = 0; r < REPEAT; r++)
+    {
+        lwp_create(sem_partner, NULL, 0);
+        start = now_ns();
+        for(i = 0; i < SYNCOPS; i++)
+        {
+            lwp_sem_post(&ping);
+            lwp_sem_wait(&pong);
+        }
+        runs[r] = (now_ns() - start) / (2 * SYNCOPS);
+        lwp_wait(NULL);
+    }
+    row("sync", "sem_pingpong", 2, 2 * SYNCOPS, median(runs, REPEAT), "ns_per_handoff");
+
+    for(r = 0; r < REPEAT; r++)
+    {
+        lwp_create(sem_timed_partner, NULL, 0);
+        start = now_ns();
+        for(i = 0; i < SYNCOPS; i++)
+        {
+            lwp_sem_post(&ping);
+            lwp_sem_timedwait(&pong, 1000000000);
+        }
+        runs[r] = (now_ns() - start) / (2 * SYNCOPS);
+        lwp_wait(NULL);
+    }
+    row("sync", "sem_timed_pingpong", 2, 2 * SYNCOPS, median(runs, REPEAT),
+        "ns_per_handoff");
+}
+
+/**
+ * @brief One producer sending to one consumer that receives until the
+ *  channel is closed. Unbuffered, every message is a rendezvous; buffered,
+ *  the two sides only meet when the channel fills or drains.
+ */
+static void bench_chan(void)
+{
+    static const unsigned int caps[] = {0, CHANCAP};
+    static const char *names[] = {"unbuffered", "buffered"};
+    double runs[REPEAT], start;
+    lwp_chan *c;
+    tid_t sink;
+    int k, r, i;
+
+    for(k = 0; k < 2; k++)
+    {
+        for(r = 0; r < REPEAT; r++)
+        {
+            if( !(c = lwp_chan_create(caps[k])) )
+                return;
+            sink = lwp_create(chan_sink, c, 0);
+            start = now_ns();
+            for(i = 0; i < CHANMSGS; i++)
+                lwp_chan_send(c, &runs);
+            lwp_chan_close(c);
+            lwp_join(sink, NULL);
+            runs[r] = (now_ns() - start) / CHANMSGS;
+            lwp_chan_destroy(c);
+        }
+        row("chan", names[k], 2, CHANMSGS, median(runs, REPEAT), "ns_per_msg");
+    }
+}
+
+/**
+ * @brief Round trips of one byte through two pipes with lwp_read() and
+ *  lwp_write(). Each side parks on its pipe until the other writes, so
+ *  every trip goes through the epoll instance.
+ */
+static void bench_io(void)
+{
+    double runs[REPEAT], start;
+    tid_t echo;
+    char c = 0;
+    int r, i;
+
+    for(r = 0; r < REPEAT; r++)
+    {
+        if(pipe(pipes[0]) < 0 || pipe(pipes[1]) < 0)
+        {
+            perror("bench_suite");
+            return;
+        }
+        echo = lwp_create(io_echo, NULL, 0);
+        start = now_ns();
+        for(i = 0; i < IOTRIPS; i++)
+        {
+            lwp_write(pipes[0][1], &c, 1);
+            lwp_read(pipes[1][0], &c, 1);
+        }
+        runs[r] = (now_ns() - start) / IOTRIPS;
+        lwp_join(echo, NULL);
+        for(i = 0; i < 4; i++)
+            lwp_close(pipes[i / 2][i % 2]);
+    }
+    row("io", "pipe_pingpong", 2, IOTRIPS, median(runs, REPEAT), "ns_per_trip");
+}
+
+/**
+ * @brief Prints one result row
+ */
+/**
+ * @brief Reads of the calling thread's value for a key, one of the first
+ *  LWP_KEYS_INLINE and one past them
+ */
+static void bench_key(void)
+{
+    static const char *names[] = {"inline", "overflow"};
+    lwp_key keys[LWP_KEYS_INLINE + 1];
+    double runs[REPEAT], start;
+    unsigned long sum;
+    int k, r, i;
+
+    for(k = 0; k <= LWP_KEYS_INLINE; k++)
+        if(lwp_key_create(&keys[k], NULL) < 0)
+            return;
+    lwp_setspecific(keys[0], &sum);
+    lwp_setspecific(keys[LWP_KEYS_INLINE], &sum);
+
+    for(k = 0; k < 2; k++)
+    {
+        for(r = 0; r < REPEAT; r++)
+        {
+            sum = 0;
+            start = now_ns();
+            for(i = 0; i < KEYGETS; i++)
+                sum += (unsigned long) lwp_getspecific(keys[k * LWP_KEYS_INLINE]);
+            runs[r] = (now_ns() - start) / KEYGETS;
+        }
+        row("key", names[k], 1, KEYGETS, median(runs, REPEAT), "ns_per_get");
+    }
+
+    for(k = 0; k <= LWP_KEYS_INLINE; k++)
+        lwp_key_delete(keys[k]);
+}
+
+/**
+ * @brief Runs POOLTASKS trivial tasks, POOLBATCH at a time, first with an
+ *  lwp_create()/lwp_wait() per task and then through a pool
+ */
+static void bench_pool(void)
+{
+    static lwp_task tasks[POOLBATCH];
+    double runs[REPEAT], start;
+    lwp_pool *p;
+    int r, i, j;
+
+    for(r = 0; r < REPEAT; r++)
+    {
+        start = now_ns();
+        for(i = 0; i < POOLTASKS; i += POOLBATCH)
+        {
+            for(j = 0; j < POOLBATCH; j++)
+                lwp_create(idle, NULL, SMALLSTACK);
+            for(j = 0; j < POOLBATCH; j++)
+                lwp_wait(NULL);
+        }
+        runs[r] = (now_ns() - start) / POOLTASKS;
+    }
+    row("pool", "spawn", POOLBATCH, POOLTASKS, median(runs, REPEAT), "ns_per_task");
+
+    for(r = 0; r < REPEAT; r++)
+    {
+        if( !(p = lwp_pool_create(POOLWORKERS)) )
+            return;
+        start = now_ns();
+        for(i = 0; i < POOLTASKS; i += POOLBATCH)
+        {
+            for(j = 0; j < POOLBATCH; j++)
+                lwp_pool_submit(p, &tasks[j], idle, NULL);
+            for(j = 0; j < POOLBATCH; j++)
+                lwp_task_wait(&tasks[j]);
+        }
+        runs[r] = (now_ns() - start) / POOLTASKS;
+        lwp_pool_destroy(p);
+    }
+    row("pool", "pool", POOLWORKERS, POOLTASKS, median(runs, REPEAT), "ns_per_task");
+}
+
+static void row(const char *bench, const char *variant, unsigned long threads,
+    unsigned long ops, double value, const char *unit)
+{
+    printf("%s,%s,%lu,%lu,%.2f,%s\n", bench, variant, threads, ops, value, unit);
+    fflush(stdout);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double median(double *v, int n)
+{
+    qsort(v, n, sizeof(double), cmp_double);
+    return v[n / 2];
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Reads the process's size and resident set from /proc, in pages
+ *
+ * @return int 0 on success, -1 if /proc couldn't be read
+ */
+static int statm(unsigned long *size, unsigned long *resident)
+{
+    FILE *f;
+    int n;
+
+    if( !(f = fopen("/proc/self/statm", "r")) )
+    {
+        perror("bench_suite");
+        return -1;
+    }
+    n = fscanf(f, "%lu %lu", size, resident);
+    fclose(f);
+    return n == 2 ? 0 : -1;
+}
+
+static int partner(void *arg)
+{
+    int i;
+
+    for(i = 0; i < YIELDS; i++)
+        lwp_yield();
+    return 0;
+}
+
+/* arg is the tid to hand straight back to, or NULL to just yield */
+static int handoff_partner(void *arg)
+{
+    int i;
+
+    for(i = 0; i < HANDOFFS; i++)
+    {
+        if(arg)
+            lwp_yield_to((tid_t) arg);
+        else
+            lwp_yield();
+    }
+    return 0;
+}
+
+static int bystander(void *arg)
+{
+    while(!stop)
+        lwp_yield();
+    return 0;
+}
+
+static int sem_partner(void *arg)
+{
+    int i;
+
+    for(i = 0; i < SYNCOPS; i++)
+    {
+        lwp_sem_wait(&ping);
+        lwp_sem_post(&pong);
+    }
+    return 0;
+}
+
+static int sem_timed_partner(void *arg)
+{
+    int i;
+
+    for(i = 0; i < SYNCOPS; i++)
+    {
+        lwp_sem_timedwait(&ping, 1000000000);
+        lwp_sem_post(&pong);
+    }
+    return 0;
+}
+
+static int chan_sink(void *arg)
+{
+    void *msg;
+
+    while(lwp_chan_recv(arg, &msg) == 0)
+        ;
+    return 0;
+}
+
+static int io_echo(void *arg)
+{
+    char c;
+    int i;
+
+    for(i = 0; i < IOTRIPS; i++)
+    {
+        lwp_read(pipes[0][0], &c, 1);
+        lwp_write(pipes[1][1], &c, 1);
+    }
+    return 0;
+}
+
+static int idle(void *arg)
+{
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * bench_workers.c - Measures how a CPU-bound workload scales with the
+ * number of workers given to lwp_set_workers().
+ * Author: Kyle Jennings
+ *
+ * Every run happens in a child process, since the library can only be
+ * started once. Output is CSV: workers,threads,ms,speedup
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "lwp.h"
+
+#define THREADS     256
+#define SLICES      64          /* yields per thread */
+#define SLICEWORK   20000       /* loop iterations between yields */
+#define MAXWORKERS  64
+
+static int crunch(void *arg);
+static double run(unsigned int n);
+
+static volatile unsigned long sink;
+
+int main(void)
+{
+    unsigned int n;
+    double ms, base = 0;
+    int fds[2];
+    pid_t pid;
+
+    printf("workers,threads,ms,speedup\n");
+    fflush(stdout);
+    for(n = 1; n <= MAXWORKERS; n *= 2)
+    {
+        if(pipe(fds) < 0 || (pid = fork()) < 0)
+        {
+            perror("bench_workers");
+            return 1;
+        }
+        if(pid == 0)
+        {
+            close(fds[0]);
+            ms = run(n);
+            if(write(fds[1], &ms, sizeof(ms)) != sizeof(ms))
+                _exit(1);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        if(read(fds[0], &ms, sizeof(ms)) != sizeof(ms))
+        {
+            fprintf(stderr, "run with %u workers failed\n", n);
+            return 1;
+        }
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+
+        if(n == 1)
+            base = ms;
+        printf("%u,%d,%.1f,%.2f\n", n, THREADS, ms, base / ms);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs THREADS crunchers on n workers and times them
+ *
+ * @param n number of workers
+ * @return double wall time in milliseconds
+ */
+static double run(unsigned int n)
+{
+    struct timespec start, end;
+    int i;
+
+    if(lwp_set_workers(n) < 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < THREADS; i++)
+        lwp_create(crunch, NULL, 0);
+    lwp_start();
+    for(i = 0; i < THREADS; i++)
+        lwp_wait(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static int crunch(void *arg)
+{
+    unsigned long x = 1;
+    int i, j;
+
+    for(i = 0; i < SLICES; i++)
+    {
+        for(j = 0; j < SLICEWORK; j++)
+            x = x * 6364136223846793005UL + 1442695040888963407UL;
+        lwp_yield();
+    }
+    sink = x;
+    return 0;
+}
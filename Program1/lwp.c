@@ -3,6 +3,7 @@
 * Author: Kyle Jennings
 */
 
+#define _GNU_SOURCE             /* REG_RIP */
 #include "lwp.h"
 #include <stdlib.h>
 #include "smartalloc.h"
@@ -12,22 +13,396 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <cpuid.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <x86intrin.h>
 
 static void lwp_wrap(lwpfun f, void *arg);
+static void lwp_resched(void);
+static void thread_park(lwp_waitq *q);
+static int thread_park_until(lwp_waitq *q, unsigned long deadline);
+static void thread_wake(thread t);
+static tid_t thread_reap(thread zombie, int *status, void (*fn)(void *),
+    void *ctx);
+static thread thread_new(lwpfun f, void *arg, size_t len, size_t reserve);
+static tid_t thread_register(thread new_thread);
+static void make_runnable(thread t);
+static void finish_switch(void);
+static int worker_start(void);
+static void *worker_main(void *arg);
+static int worker_idle(void *arg);
+static thread worker_next(void);
+static void mutex_wake(lwp_mutex *m);
+static int chan_try_send(lwp_chan *c, void *msg, int *res, thread *to);
+static int chan_try_recv(lwp_chan *c, void **msg, int *res);
+static int chan_select(lwp_chan_op *ops, int n, int block,
+    unsigned long deadline);
+static int chan_park(lwp_chan_op *ops, int n, unsigned long deadline);
+static int io_prepare(int fd);
+static int io_wait(int fd, short events, unsigned long deadline);
+static int fd_wait(int fd, short events, unsigned long deadline);
+static void timer_add(thread t, unsigned long deadline);
+static void timer_cancel(thread t);
+static void timer_insert(thread t);
+static void timer_fire(thread t);
+static unsigned long timer_next(void);
+static void timer_run(void);
+static void idle_wait(void);
+static unsigned long clock_ns(void);
+static void trace_event(unsigned int type, tid_t tid, tid_t arg);
+static void key_cleanup(thread t);
+static int pool_worker(void *arg);
+static void spawn_start(void);
+static void spawn_run(lwp_spawner *sp, lwp_task *task);
+static void spawn_unlink(thread owner, lwp_task *task);
+static void spawn_steal(void);
+static int spawn_helper(void *arg);
+static int carrier_init(void);
+static int carrier_main(void *arg);
+static void thread_retire(thread self, int status);
+static void step_wake(thread t);
+static int io_poll(int timeout);
+static void preempt_tick(int sig, siginfo_t *info, void *uctx);
+static void preempt_now(void);
 static void r_admit(thread new);
 static void r_remove(thread victim);
 static thread r_next(void);
-void *malloc_16(size_t size);
-void free_16(void *ptr);
+static void sched_handoff(thread t);
+static void list_push(thread *head, thread t);
+static void list_unlink(thread *head, thread t);
+static int stack_init(void);
+static unsigned long *stack_alloc(size_t size, int guard);
+static void stack_free(unsigned long *stack, size_t size, int guard);
+static thread ctx_alloc(void);
+static void *slab_cut(size_t size);
+static void *xsave_alloc(void);
+static void fpu_probe(void);
+static tid_t tid_alloc(thread t);
+static void tid_release(tid_t tid);
+static thread tid_lookup(tid_t tid);
+static void waitq_push(lwp_waitq *q, thread t);
+static thread waitq_pop(lwp_waitq *q);
+static void waitq_remove(lwp_waitq *q, thread t);
+static void ctx_free(thread t);
 
 static struct scheduler publish = {NULL, NULL, r_admit, r_remove, r_next};
 
-static int counter = 1;
+/* per kernel thread state. initial-exec keeps each access a single
+   %fs-relative load, which also means it is re-read after a switch that
+   moved the thread to another worker */
+#define LWP_TLS __thread __attribute__ ((tls_model ("initial-exec")))
+
 static scheduler ActiveScheduler = &publish;
-static thread ActiveThread = NULL;
+
+/* lwp_set_handoff_hook() registrations, kept outside struct scheduler so
+   schedulers built against its five members still work */
+#define HANDOFF_HOOKS 8
+static struct {
+    scheduler sched;
+    void (*hook)(thread t);
+} handoff_hooks[HANDOFF_HOOKS];
+static void (*ActiveHandoff)(thread t);     /* ActiveScheduler's, or NULL */
+
+static LWP_TLS thread ActiveThread = NULL;
+
+/* live threads and zombies are doubly-linked through the library pointers */
+#define lnext lib_one
+#define lprev lib_two
 
 static thread lib_tlist;
 static thread zombies;
+static unsigned long lib_live;      /* threads on lib_tlist */
+static unsigned long lib_zombies;   /* threads on zombies */
+static unsigned long lib_parked;    /* live threads that are parked */
+
+static lwp_waitq reapers;           /* threads parked in lwp_wait() */
+
+/* multi-worker runtime. Each worker is a kernel thread with its own run
+   deque of fresh threads that idle workers steal from (Chase-Lev), and its
+   own instance of the scheduler for the threads it has taken on */
+#define CL_SIZE         4096        /* slots in a run deque, a power of 2 */
+#define IDLE_STACK      4096        /* words of stack for worker 0's idle */
+#define IDLE_MAXNAP     1000000     /* longest an idle worker naps, in ns */
+
+typedef struct cldeque {
+    long   top __attribute__ ((aligned (64)));     /* thieves take here   */
+    long   bottom __attribute__ ((aligned (64)));  /* owner pushes/pops   */
+    thread buf[CL_SIZE];
+} cldeque;
+
+typedef struct worker {
+    cldeque       deque;        /* fresh threads, open to stealing      */
+    thread        idle;         /* context running this worker's idle   */
+    thread        carrier;      /* stack this worker's steps run on     */
+    pthread_t     pthread;
+    unsigned long seed;         /* for picking steal victims            */
+} worker;
+
+static unsigned int nworkers = 1;
+static worker *workers;
+static int lib_started;
+static LWP_TLS worker *Self;        /* worker this kernel thread runs     */
+static LWP_TLS thread LastThread;   /* switched away from, see finish_switch */
+
+/* preemption. A SIGALRM from a CPU-time timer switches threads unless it
+   lands in a critical section, in which case it is left pending for the
+   end of the section. Every switch happens inside one, and the code a
+   switch lands in ends it */
+static LWP_TLS volatile int preempt_off;     /* critical section depth */
+static volatile sig_atomic_t preempt_pending;
+static LWP_TLS int preempting;      /* this switch is a tick's doing */
+static int preempt_on;
+static timer_t preempt_timer;
+static struct sigaction preempt_oldact;
+
+#define CRIT_ENTER()    do { preempt_off++; \
+                             __atomic_signal_fence(__ATOMIC_SEQ_CST); } while(0)
+#define CRIT_EXIT()     do { __atomic_signal_fence(__ATOMIC_SEQ_CST); \
+                             if(--preempt_off == 0 && preempt_pending) \
+                                 preempt_now(); } while(0)
+
+/* channels. A thread blocked on a channel is parked with a chanwait on its
+   own stack queued on the channel; a select queues one per case, all
+   sharing a chansel that records which case went first */
+typedef struct chansel {
+    thread           t;
+    struct chanwait  *fired;    /* case that completed, NULL until then */
+} chansel;
+
+typedef struct chanwait {
+    struct chanwait  *next;
+    struct chanwait  *prev;
+    chansel          *sel;
+    void             *msg;      /* message to send, or the one received */
+    int              ok;        /* 0 delivered, -1 channel closed       */
+    int              index;     /* case number within the select        */
+    int              queued;
+} chanwait;
+
+typedef struct chanq {
+    chanwait *head;
+    chanwait *tail;
+} chanq;
+
+struct lwp_chan {
+    void          **buf;        /* ring of cap messages              */
+    unsigned int  cap;
+    unsigned int  head;         /* oldest message                    */
+    unsigned int  count;
+    int           closed;
+    chanq         senders;      /* parked with a message to hand off */
+    chanq         receivers;    /* parked waiting for one            */
+};
+
+static unsigned int chan_seed;  /* rotates where select starts looking */
+
+static void chanq_push(chanq *q, chanwait *w);
+static void chanq_unlink(chanq *q, chanwait *w);
+static chanwait *chanq_take(chanq *q);
+static void chan_fire(chanwait *w, int ok);
+
+/* blocking I/O. Threads that would block on an fd park on its entry in
+   io_fds; the fd is armed one-shot in the epoll instance for whatever its
+   waiters want, and the scheduler polls it */
+#define IO_EVENTS       64          /* events taken per epoll_wait()       */
+#define IO_POLL_EVERY   64          /* reschedules between quick polls     */
+
+typedef struct iofd {
+    lwp_waitq     readers;
+    lwp_waitq     writers;
+    lwp_waitq     pollers;      /* in lwp_poll(), woken by any event  */
+    short         pollev;       /* what the pollers are waiting for   */
+    char          nonblock;     /* we have set O_NONBLOCK on it       */
+    char          added;        /* registered with io_epfd            */
+} iofd;
+
+static int io_epfd = -1;
+static iofd *io_fds;                /* indexed by fd */
+static int io_nfds;
+static volatile unsigned long io_waiting;   /* threads parked on an fd */
+static LWP_TLS unsigned int io_ticks;
+
+static iofd *io_slot(int fd);
+static int io_arm(int fd, iofd *f, short events);
+static void io_ready(int fd, unsigned int events);
+
+/* timers. Threads with a deadline sit in a hierarchical timing wheel:
+   TW_LEVELS wheels of TW_SLOTS slots, where a slot of each wheel spans a
+   whole turn of the one below. A deadline goes in the wheel of the highest
+   bit group it differs from the current tick in, and moves down a wheel
+   when its slot comes up, so adding and cancelling are O(1). Each wheel
+   has a bitmap of its occupied slots to find the next one without
+   stepping through empty ticks. */
+#define TW_SHIFT        10          /* a tick is 2^10 ns, about 1us       */
+#define TW_BITS         6
+#define TW_SLOTS        (1 << TW_BITS)
+#define TW_LEVELS       6           /* 2^36 ticks, about 19 hours, ahead  */
+#define TW_NONE         (~0UL)
+
+static thread tw_wheel[TW_LEVELS][TW_SLOTS];
+static unsigned long tw_used[TW_LEVELS];    /* bit n: slot n has timers  */
+static unsigned long tw_now;                /* first tick not yet run     */
+static volatile unsigned long tw_due = TW_NONE; /* next tick with work    */
+static volatile unsigned long tw_count;     /* timers in the wheels       */
+static int tw_fd = -1;          /* timerfd that ends an epoll_wait()      */
+
+/* tracing. Scheduling events go into a ring that every worker writes
+   without a lock: a writer claims a slot by bumping trace_head, and the
+   slot's seq says which claim it holds once the event is complete. The
+   ring wraps, keeping the latest events. */
+#define TRACE_DEFEVENTS (1 << 16)   /* ring size if none is given         */
+
+enum { TR_CREATE, TR_ADMIT, TR_SWITCH, TR_EXIT, TR_WAIT };
+
+typedef struct trace_ev {
+    unsigned long seq;          /* claim number + 1, 0 while written  */
+    unsigned long tsc;
+    tid_t         tid;          /* thread the event is about          */
+    tid_t         arg;          /* other thread, or the exit status   */
+    unsigned int  type;
+    unsigned int  cpu;          /* worker it happened on              */
+} trace_ev;
+
+static trace_ev *trace_buf;
+static unsigned long trace_mask;
+static unsigned long trace_head;
+static volatile int trace_on;
+static unsigned long trace_tsc0;    /* when tracing started, to scale the */
+static unsigned long trace_ns0;     /* TSC to wall time in the dump       */
+
+/* LWP-local storage. A thread's values for the first LWP_KEYS_INLINE keys
+   sit in its context; the rest go in a table hung off it the first time
+   one of them is set */
+#define KEY_ROUNDS      4           /* passes over the destructors at exit */
+
+static void (*key_dtor[LWP_KEYS_MAX])(void *);
+static char key_used[LWP_KEYS_MAX];
+
+/* worker pools. Tasks queue in order on the pool, and workers with
+   nothing to run park on it */
+struct lwp_pool {
+    lwp_task      *head;
+    lwp_task      *tail;
+    lwp_waitq     idle;         /* workers parked waiting for a task */
+    int           closing;      /* no new tasks, workers may exit    */
+    unsigned int  n;            /* workers started                   */
+    tid_t         tids[];
+};
+
+/* fork-join. Spawned tasks sit on their thread's deque. With several
+   workers there is a helper thread for each extra one, which steals the
+   oldest task from a thread on spawn_victims */
+static thread spawn_victims;        /* threads with spawned tasks queued */
+static lwp_waitq spawn_idle;        /* helpers with nothing to steal     */
+static unsigned int spawn_helpers;  /* helpers alive                     */
+static int spawn_started;
+static int spawn_quit;              /* only helpers are left             */
+
+/* stackless threads. Each worker has one carrier context with a stack,
+   and when the scheduler picks a stackless thread the carrier runs its
+   step on that stack in the thread's name */
+static thread carrier;              /* the carrier with a single worker   */
+static volatile char carrier_lock;
+static int carriers_made;
+static LWP_TLS int Stepping;        /* inside a step, can't switch away   */
+
+#define TRACE(type, tid, arg) \
+    do { if(trace_on) trace_event((type), (tid), (arg)); } while(0)
+
+/* library lists, tids and stacks are shared between workers. With a single
+   worker the only other party is the preemption tick */
+static volatile char lib_lock;
+#define LIB_LOCK()      do { if(nworkers > 1) spin_lock(&lib_lock); \
+                             else CRIT_ENTER(); } while(0)
+#define LIB_UNLOCK()    do { if(nworkers > 1) spin_unlock(&lib_lock); \
+                             else CRIT_EXIT(); } while(0)
+
+static inline void spin_lock(volatile char *lock)
+{
+    while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+        while(*lock)
+            __builtin_ia32_pause();
+}
+
+static inline void spin_unlock(volatile char *lock)
+{
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+/* tid lookup table. A tid is a slot index in the low bits with the slot's
+   generation above it, so a stale tid never matches the slot's next owner */
+#define TID_SLOTBITS    32
+#define TID_SLOTMASK    ((1UL << TID_SLOTBITS) - 1)
+#define TID_INITSLOTS   64
+
+typedef struct tidslot {
+    tid_t  tid;         /* tid of the owner, or the next tid to issue */
+    thread owner;       /* thread holding the slot, NULL when free    */
+} tidslot;
+
+static tidslot *tid_table;
+static unsigned long tid_cap;       /* allocated slots                    */
+static unsigned long tid_top = 1;   /* slots ever used (0 is NO_THREAD)   */
+static unsigned long *tid_free;     /* stack of released slot indices     */
+static unsigned long tid_nfree;
+
+/* stack pool. Freed stacks are kept per size, and apart by whether they
+   have a guard page, and reused by lwp_create(), linked through their top
+   word. Past the first few, pooled stacks are
+   madvise()d away so an idle pool doesn't pin memory */
+#define POOL_SIZES      8       /* distinct stack sizes the pool tracks */
+#define POOL_DEFCAP     64      /* default stacks kept per size         */
+#define POOL_HOT        4       /* pooled stacks per size left resident */
+
+typedef struct stackpool {
+    size_t        size;         /* size of the stacks in this bucket */
+    int           guarded;      /* TRUE if their lowest page is one  */
+    unsigned long *head;        /* most recently freed stack         */
+    unsigned int  count;        /* stacks in the bucket              */
+} stackpool;
+
+static stackpool pool[POOL_SIZES];
+static unsigned int pool_cap = POOL_DEFCAP;
+static lwp_poolstats pool_stats;
+
+/* contexts are cut from slabs mapped SLAB_SIZE at a time, each in a slot
+   on a cache line boundary. XSAVE areas are cut from the same slabs, but
+   only for LWP_FPU threads, when lwp_set_fpu() first marks them. Freed
+   contexts and areas go on a list each, linked through their first word,
+   and slabs are never unmapped */
+#define SLAB_SIZE       (256 * 1024)
+#define CTX_ALIGN       64
+#define CTX_ROUND(n)    (((n) + CTX_ALIGN - 1) & ~(size_t) (CTX_ALIGN - 1))
+
+static thread ctx_list;         /* freed contexts                      */
+static void *xsave_list;        /* freed XSAVE areas                   */
+static char *slab_next;         /* uncut part of the newest slab       */
+static char *slab_end;
+
+/* extended state. When the CPU has XSAVE an LWP_FPU thread's context gets
+   an area sized by CPUID, and swap_rfiles picks the instruction from
+   lwp_xsave_mode. Everyone else's state fits the fxsave area */
+#define XSAVE_PLAIN     1
+#define XSAVE_OPT       2       /* init and modified optimizations */
+#define XSAVE_C         3       /* init optimization, compacted    */
+
+int lwp_xsave_mode;
+static size_t xsave_size;
+static int fpu_probed;
+
+static long pagesize;           /* cached so lwp_create makes no syscalls */
+static size_t default_stacksize;
+static int stack_guard = TRUE;  /* put a PROT_NONE page under new stacks  */
+#define STACK_MINPAGES  4       /* smallest stack lwp_create will build   */
 
 
 /**
@@ -37,61 +412,151 @@ static thread zombies;
  * 
  * @param f starting function of the thread
  * @param arg argument for the starting function
- * @param len not used
+ * @param len size of the stack in words, or 0 for the RLIMIT_STACK size
  * @return tid_t id of the created thread or NULL if there was an error
  */
 tid_t lwp_create(lwpfun f, void *arg, size_t len)
 {
     thread new_thread;
-    long pagesize;
-    struct rlimit rlim;
-    unsigned long *stack_top;
-    int i;
+    tid_t tid;
 
-    if( !(new_thread = (thread) malloc_16(sizeof(context))) )
-    {
+    if( !(new_thread = thread_new(f, arg, len, 0)) )
+        return NO_THREAD;
+    if( (tid = thread_register(new_thread)) == NO_THREAD )
         return NO_THREAD;
-    }
-    memset(new_thread, 0, sizeof(context));
-    
-    /* setup the FP register */
-    new_thread->state.fxsave = FPU_INIT;
 
-    /* set the tid */
-    new_thread->tid = counter++;
+    /* add the thread to the scheduler (once it's there another worker
+       may already be running it) */
+    TRACE(TR_CREATE, tid, lwp_gettid());
+    make_runnable(new_thread);
 
-    /* get the stack/stacksize */
-    /* get the page size */
-    pagesize = sysconf(_SC_PAGE_SIZE);
+    return tid;
+}
 
-    /* get the max stack size */
-    if(getrlimit(RLIMIT_STACK, &rlim) < 0)
-    {
-        /* failed to get stack size */
+
+/**
+ * @brief lwp_create() for an argument that lives at the top of the new
+ *  thread's own stack instead of somewhere the caller has to keep alive.
+ *  size bytes are set aside there, init(where, ctx) builds the argument in
+ *  them before the thread can run, and the thread starts as f(where).
+ *  init must not fail.
+ * 
+ * @param f starting function of the thread
+ * @param size bytes of argument, kept 16-byte aligned
+ * @param init builds the argument
+ * @param ctx passed on to init
+ * @param len size of the stack in words, not counting the argument, or 0
+ *  for the RLIMIT_STACK size
+ * @return tid_t id of the created thread or NO_THREAD if there was an error
+ */
+tid_t lwp_create_inplace(lwpfun f, size_t size, lwpinit init, void *ctx,
+                         size_t len)
+{
+    thread new_thread;
+    tid_t tid;
+
+    if( !(new_thread = thread_new(f, NULL, len, size)) )
         return NO_THREAD;
-    }
-    if(rlim.rlim_cur == RLIM_INFINITY)
+    if( (tid = thread_register(new_thread)) == NO_THREAD )
+        return NO_THREAD;
+
+    init((void *) new_thread->state.rsi, ctx);
+    TRACE(TR_CREATE, tid, lwp_gettid());
+    make_runnable(new_thread);
+
+    return tid;
+}
+
+
+/**
+ * @brief Gives a new thread its tid and puts it on the library list, live
+ *  but not runnable yet. If that fails the thread is freed.
+ * 
+ * @param new_thread thread from thread_new()
+ * @return tid_t its tid, or NO_THREAD if the tid table couldn't grow
+ */
+static tid_t thread_register(thread new_thread)
+{
+    tid_t tid;
+
+    LIB_LOCK();
+    if( (tid = tid_alloc(new_thread)) != NO_THREAD )
     {
-        /* No limit, so we set it to 8MB */
-        new_thread->stacksize = (2 << 23);
+        new_thread->tid = tid;
+        new_thread->status = MKTERMSTAT(LWP_LIVE, 0);
+        list_push(&lib_tlist, new_thread);
+        lib_live++;
     }
     else
     {
-        /* There is a limit, round it up to the nearest page */
-        if (rlim.rlim_cur % pagesize > 0)
-            new_thread->stacksize = rlim.rlim_cur + (pagesize - (rlim.rlim_cur % pagesize));
-        else
-            new_thread->stacksize = rlim.rlim_cur;
+        if(new_thread->stack)
+            stack_free(new_thread->stack, new_thread->stacksize,
+                       new_thread->flags & LWP_GUARDED);
+        ctx_free(new_thread);
+    }
+    LIB_UNLOCK();
+
+    return tid;
+}
+
+
+/**
+ * @brief Builds a context and a stack that will start running f(arg) in
+ *  lwp_wrap the first time it is switched to. The thread has no tid and
+ *  isn't on any list yet. With a reserve, that many bytes at the top of
+ *  the stack are kept out of the way of the thread and passed as its
+ *  argument instead of arg.
+ * 
+ * @param f starting function of the thread
+ * @param arg argument for the starting function
+ * @param len size of the stack in words, or 0 for the RLIMIT_STACK size
+ * @param reserve bytes to set aside at the top of the stack, or 0
+ * @return thread the new thread or NULL if there was an error
+ */
+static thread thread_new(lwpfun f, void *arg, size_t len, size_t reserve)
+{
+    thread new_thread;
+    unsigned long *stack, *stack_top;
+    int i;
+
+    if(!default_stacksize && stack_init() < 0)
+        return NULL;
+
+    if( !(new_thread = ctx_alloc()) )
+    {
+        return NULL;
     }
 
-    /* allocate the stack */
-    new_thread->stack = (unsigned long *) mmap(NULL, new_thread->stacksize, 
-        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-    if(new_thread->stack < 0)
+    /* size the stack: len words rounded up to a page, plus the guard page.
+       The guard is part of the mapping, so stack/stacksize cover it too */
+    if(len)
     {
-        perror("mmap");
-        return NO_THREAD;
+        new_thread->stacksize = len * sizeof(unsigned long);
+        if(new_thread->stacksize % pagesize > 0)
+            new_thread->stacksize += pagesize - (new_thread->stacksize % pagesize);
+        if(new_thread->stacksize < STACK_MINPAGES * pagesize)
+            new_thread->stacksize = STACK_MINPAGES * pagesize;
     }
+    else
+        new_thread->stacksize = default_stacksize;
+    reserve = (reserve + 15) & ~(size_t) 15;
+    if(reserve)
+        new_thread->stacksize += (reserve + pagesize - 1) & ~(pagesize - 1);
+    if(stack_guard)
+    {
+        new_thread->stacksize += pagesize;
+        new_thread->flags |= LWP_GUARDED;
+    }
+
+    /* get a stack, from the pool if we can */
+    LIB_LOCK();
+    if( !(stack = stack_alloc(new_thread->stacksize,
+                              new_thread->flags & LWP_GUARDED)) )
+        ctx_free(new_thread);
+    LIB_UNLOCK();
+    if(!stack)
+        return NULL;
+    new_thread->stack = stack;
     
     /* add the function from the signature */
     new_thread->state.rdi = (unsigned long) f;
@@ -105,6 +570,17 @@ tid_t lwp_create(lwpfun f, void *arg, size_t len)
     /* NOTE: Check that stack_top is divisible by sixteen */
     if( (i = ((unsigned long) stack_top) % 16) > 0)
         stack_top = (unsigned long *) (((unsigned long) stack_top) - i);
+
+    /* the argument goes above everything else */
+    if(reserve)
+    {
+        stack_top = (unsigned long *) ((char *) stack_top - reserve);
+        new_thread->state.rsi = (unsigned long) stack_top;
+    }
+
+    /* skip a word so lwp_wrap is entered with rsp+8 on a 16-byte boundary,
+       like any other called function */
+    stack_top -= 1;
     
     /* save the top of the stack to rbp for later */
     new_thread->state.rbp = (unsigned long) stack_top;
@@ -123,22 +599,7 @@ tid_t lwp_create(lwpfun f, void *arg, size_t len)
     /* change rbp to point below the stack frame just created */
     new_thread->state.rbp = (unsigned long) stack_top;
 
-    /* add the thread to the scheduler */
-    ActiveScheduler->admit(new_thread);
-
-    /* add the thread to the library list */
-    if(!lib_tlist)
-        lib_tlist = new_thread;
-    else
-    {
-        new_thread->lib_one = lib_tlist;
-        lib_tlist = new_thread;
-    }
-
-    /* set the status to live */
-    new_thread->status = MKTERMSTAT(LWP_LIVE, 0);
-
-    return new_thread->tid;
+    return new_thread;
 }
 
 
@@ -150,44 +611,57 @@ tid_t lwp_create(lwpfun f, void *arg, size_t len)
  */
 void lwp_exit(int status)
 {
-    thread l;
-    context dummy;
+    thread self = ActiveThread;
 
-    /* Remove the current process from the scheduler and save the status */
-    ActiveScheduler->remove(ActiveThread);
-    ActiveThread->status = MKTERMSTAT(LWP_TERM,status);
+    /* children and destructors are ordinary code that may block, so they
+       run first */
+    if(self->spawn.head || self->spawn.stolen)
+        lwp_sync();
+    key_cleanup(self);
 
-    /* If there are zombies already, add the thread to the beginning of the
-       list */
-    if(zombies)
-    {
-        ActiveThread->lib_one = zombies;
-        zombies = ActiveThread;
-    }
-    /* Otherwise it becomes the beginning */
-    else
+    /* We never leave this critical section; the switch away ends it */
+    CRIT_ENTER();
+    thread_retire(self, status);
+
+    /* Let other threads run */
+    lwp_resched();
+}
+
+
+/**
+ * @brief Takes an exiting thread out of the scheduler and hands it to
+ *  whoever reaps it: a thread in lwp_join() on it, or else the zombie list
+ *  and one lwp_wait()er. Called in a critical section, just before
+ *  switching away from it for good.
+ * 
+ * @param self the exiting thread
+ * @param status its exit status
+ */
+static void thread_retire(thread self, int status)
+{
+    ActiveScheduler->remove(self);
+    TRACE(TR_EXIT, self->tid, status);
+
+    LIB_LOCK();
+    self->status = MKTERMSTAT(LWP_TERM,status);
+    list_unlink(&lib_tlist, self);
+    lib_live--;
+    if(spawn_helpers && lib_live == spawn_helpers)
     {
-        zombies = ActiveThread;
-        ActiveThread->lib_one = NULL;
+        spawn_quit = TRUE;
+        while(spawn_idle.head)
+            thread_wake(waitq_pop(&spawn_idle));
     }
-
-    /* update the head of our active threads */
-    if(ActiveThread == lib_tlist)
-        lib_tlist = lib_tlist->lib_one;
+    if(self->joiner)
+        step_wake(self->joiner);
     else
     {
-        /* remove it from the library list */
-        dummy.lib_one = lib_tlist;
-        for(l = &dummy; l->lib_one && l->lib_one != ActiveThread; l = l->lib_one);
-
-        if(l->lib_one)
-        {
-            l->lib_one = l->lib_one->lib_one;
-        }
+        list_push(&zombies, self);
+        lib_zombies++;
+        if(reapers.head)
+            thread_wake(waitq_pop(&reapers));
     }
-
-    /* Let other threads run */
-    lwp_yield();
+    LIB_UNLOCK();
 }
 
 
@@ -202,6 +676,13 @@ static void lwp_wrap(lwpfun f, void *arg)
 {
     int rval;
     
+    /* we got here through a switch like any other, but start outside of
+       the switcher's critical section */
+    if(nworkers > 1)
+        finish_switch();
+    preempt_off = 1;
+    CRIT_EXIT();
+
     rval = f(arg);
     lwp_exit(rval);
 }
@@ -223,16 +704,88 @@ tid_t lwp_gettid(void)
 
 
 /**
- * @brief Calls swap_rfiles without the interference of locals
+ * @brief Switches between two threads without the interference of locals.
+ *  A switch is always a function call, so only the callee-saved registers
+ *  and the FPU control words have to survive it; swap_lean does just that.
+ *  The full register file and fxsave area are only moved when one of the
+ *  threads is marked LWP_FPU.
+ *
+ *  With several workers the thread we're switching to may have just been
+ *  switched out on another one, so we wait until its registers are saved.
+ *
+ *  Stackless threads have no registers of their own: whichever runs, it
+ *  runs on this worker's carrier, so between two of them there is nothing
+ *  to swap.
  * 
- * @param old previous thread registers
- * @param new new thread registers
+ * @param old previous thread
+ * @param new new thread
  * 
  * @return does not return
  */
-void lwp_yield_helper(rfile *old, rfile *new)
+void lwp_yield_helper(thread old, thread new)
 {
-    swap_rfiles(old, new);
+    int depth = preempt_off;
+    unsigned long now;
+    thread from = old, to = new;
+
+    /* the carrier's registers are partway through a step */
+    if(Stepping)
+    {
+        fputs("lwp: a stackless LWP blocked or yielded inside a step\n",
+            stderr);
+        abort();
+    }
+
+    ActiveThread = new;
+    if(old == new)
+    {
+        preempting = FALSE;
+        return;
+    }
+
+    /* the statistics are a TSC read and a few increments, cheap enough to
+       leave on. Cycles start counting from a thread's first switch in */
+    now = __rdtsc();
+    if(old->tsc_in)
+        old->stats.cycles += now - old->tsc_in;
+    old->stats.switches_out++;
+    if(preempting)
+        old->stats.involuntary++;
+    else
+        old->stats.voluntary++;
+    preempting = FALSE;
+    new->stats.switches_in++;
+    new->tsc_in = now;
+    TRACE(TR_SWITCH, old->tid, new->tid);
+
+    if(nworkers > 1)
+    {
+        while(__atomic_load_n(&new->oncpu, __ATOMIC_ACQUIRE))
+            __builtin_ia32_pause();
+        new->oncpu = TRUE;
+        LastThread = old;
+    }
+
+    if(old->flags & LWP_STACKLESS)
+        from = nworkers > 1 ? Self->carrier : carrier;
+    if(new->flags & LWP_STACKLESS)
+        to = nworkers > 1 ? Self->carrier : carrier;
+    if(from == to)
+    {
+        if(nworkers > 1)
+            finish_switch();
+        return;
+    }
+
+    if((from->flags | to->flags) & LWP_FPU)
+        swap_rfiles(&(from->state), &(to->state));
+    else
+        swap_lean(&(from->state), &(to->state));
+
+    /* critical sections belong to the thread, so put ours back */
+    preempt_off = depth;
+    if(nworkers > 1)
+        finish_switch();
 }
 
 
@@ -245,169 +798,3428 @@ void lwp_yield_helper(rfile *old, rfile *new)
  * @return does not return
  */
 void lwp_yield(void)
+{
+    CRIT_ENTER();
+    lwp_resched();
+    CRIT_EXIT();
+}
+
+
+/**
+ * @brief Hands the CPU straight to the given thread instead of whichever
+ *  one the scheduler would pick. The scheduler is told through
+ *  sched_handoff(), so the target goes to the back of its queue as if
+ *  next() had just picked it and the caller stays where it was, and
+ *  FairShare charges the time that follows to the target rather than the
+ *  caller. With several workers the thread may belong to another worker's
+ *  scheduler, so this is an ordinary lwp_yield() there.
+ * 
+ * @param tid thread to run
+ * @return int 0 once the caller runs again, or -1 straight away if tid
+ *  isn't a runnable thread other than the caller
+ */
+int lwp_yield_to(tid_t tid)
+{
+    thread self = ActiveThread;
+    thread t;
+    int ok;
+
+    CRIT_ENTER();
+    LIB_LOCK();
+    t = tid_lookup(tid);
+    ok = t && t != self && !(t->flags & LWP_PARKED) &&
+        !LWPTERMINATED(t->status);
+    LIB_UNLOCK();
+
+    if(!ok)
+    {
+        CRIT_EXIT();
+        return -1;
+    }
+
+    if(nworkers > 1)
+        lwp_resched();
+    else
+    {
+        /* the same look in for timers and I/O as lwp_resched() gives */
+        if(tw_count)
+            timer_run();
+        if(io_waiting && ++io_ticks % IO_POLL_EVERY == 0)
+            io_poll(0);
+
+        sched_handoff(t);
+        preempt_pending = FALSE;
+        lwp_yield_helper(self, t);
+    }
+    CRIT_EXIT();
+    return 0;
+}
+
+
+/**
+ * @brief Does the work of lwp_yield() for a caller that is already in a
+ *  critical section, so a preemption tick can't get between it picking a
+ *  thread and switching to it.
+ */
+static void lwp_resched(void)
 {
     int status;
+    thread next;
     
     /* save the old thread and get the next thread */
     thread prev_thread = ActiveThread;
-    ActiveThread = ActiveScheduler->next();
 
-    /* If we have threads left, yield to them */
-    if(ActiveThread)
-        lwp_yield_helper(&(prev_thread->state), &(ActiveThread->state));
-    /* Otherwise deallocate the current thread and exit the program. */
+    /* threads waiting on timers or I/O get a look in every so often even
+       when the run queue never drains */
+    if(tw_count)
+        timer_run();
+    if(io_waiting && ++io_ticks % IO_POLL_EVERY == 0)
+        io_poll(0);
+
+    if(nworkers > 1)
+        next = worker_next();
+    else
+    {
+        next = ActiveScheduler->next();
+        /* everyone left is waiting on a timer or I/O, so sleep until one
+           comes through */
+        while(!next && (io_waiting || tw_count))
+        {
+            idle_wait();
+            next = ActiveScheduler->next();
+        }
+    }
+
+    /* If we have threads left, yield to them. Any switch answers a
+       pending tick */
+    preempt_pending = FALSE;
+    if(next)
+        lwp_yield_helper(prev_thread, next);
+    /* a worker with nothing of its own to run idles while other workers
+       still have threads */
+    else if(nworkers > 1 && lib_live)
+        lwp_yield_helper(prev_thread, Self->idle);
+    /* Otherwise deallocate the current thread and exit the program. We may
+       still be running on its stack, so that is left for exit() to unmap */
     else
     {
-        if(prev_thread->stack)
-            munmap(prev_thread->stack, prev_thread->stacksize);
         status = MKTERMSTAT(LWP_TERM, prev_thread->status);
-        free_16(prev_thread);
+        tid_release(prev_thread->tid);
+        free(tid_table);
+        free(tid_free);
+        if(io_fds)
+            free(io_fds);
+        if(trace_buf)
+            free(trace_buf);
         exit(status);
     }
 }
 
 
 /**
- * @brief Starts the LWP system. Converts the calling thread into a LWP
- *  and lwp_yield()s to whichever thread the scheduler chooses.
+ * @brief Blocks the calling thread: takes it out of the scheduler, queues
+ *  it on q if there is one, and switches away until thread_wake(). Called
+ *  with the library locked and returns with it locked again; whatever the
+ *  caller is waiting for has to be rechecked since another thread may have
+ *  gotten there first.
  * 
+ * @param q wait queue to join, or NULL if the waker knows who we are
  */
-void lwp_start(void)
+static void thread_park(lwp_waitq *q)
 {
-    thread new_thread;
+    thread self = ActiveThread;
 
-    /* create a 16-byte aligned thread */
-    new_thread = (thread) malloc_16(sizeof(context));
-    memset(new_thread, 0, sizeof(context));
+    ActiveScheduler->remove(self);
+    self->flags |= LWP_PARKED;
+    lib_parked++;
+    if(q)
+        waitq_push(q, self);
 
-    /* set the tid */
-    new_thread->tid = counter++;
+    /* with one worker the lock is a critical section, which the switch
+       carries over. A spinlock can't be held across it, and a waker that
+       gets in between waits for us to finish switching out (oncpu) */
+    if(nworkers > 1)
+    {
+        spin_unlock(&lib_lock);
+        lwp_resched();
+        spin_lock(&lib_lock);
+    }
+    else
+        lwp_resched();
+}
 
-    /* mark the stack so we don't free it */
-    new_thread->stack = NULL;
-    new_thread->stacksize = 0;
 
-    /* Admit the new thread and set is as active */
-    ActiveScheduler->admit(new_thread);
-    ActiveThread = new_thread;
+/**
+ * @brief thread_park() with a deadline. If the deadline passes first the
+ *  thread is taken off whatever wait queue it is on and woken anyway.
+ *  Library locked.
+ * 
+ * @param q wait queue to join, or NULL
+ * @param deadline CLOCK_MONOTONIC time in ns to give up at, or 0 for none
+ * @return int 0 if woken, -1 if the deadline passed
+ */
+static int thread_park_until(lwp_waitq *q, unsigned long deadline)
+{
+    thread self = ActiveThread;
 
-    /* add the thread to the library list */
-    if(!lib_tlist)
-        new_thread = lib_tlist;
-    else
+    if(deadline)
     {
-        new_thread->lib_one = lib_tlist;
-        lib_tlist = new_thread;
+        if(deadline <= clock_ns())
+        {
+            if(self->waitq)
+                waitq_remove(self->waitq, self);
+            return -1;
+        }
+        timer_add(self, deadline);
     }
 
-    /* throw yourself upon the mercy of the almighty scheduler */
-    lwp_yield();
+    thread_park(q);
+
+    if(self->flags & LWP_TIMEDOUT)
+    {
+        self->flags &= ~LWP_TIMEDOUT;
+        return -1;
+    }
+    return 0;
 }
 
 
 /**
- * @brief Waits for a thread to terminate, deallocates its
- *  resources, and reports its termination status if status is non-NULL.
- *  Returns the tid of the terminated thread or NO_THREAD
+ * @brief Makes a parked thread runnable again. Called with the library
+ *  locked, after taking the thread off whatever wait queue it was on.
  * 
- * @param status 
- * @return tid_t 
+ * @param t the thread to wake
  */
-tid_t lwp_wait(int *status)
+static void thread_wake(thread t)
+{
+    if(t->flags & LWP_TIMED)
+        timer_cancel(t);
+    t->flags &= ~LWP_PARKED;
+    lib_parked--;
+    make_runnable(t);
+}
+
+
+/**
+ * @brief Frees a zombie that has been taken off the zombie list (or was
+ *  never on it) and reports its status
+ * 
+ * @param zombie the thread to free
+ * @param status where to put its termination status, or NULL
+ * @param fn called with ctx while its stack is still mapped, or NULL
+ * @param ctx passed to fn
+ * @return tid_t its tid
+ */
+static tid_t thread_reap(thread zombie, int *status, void (*fn)(void *),
+    void *ctx)
 {
-    thread zombie;
     tid_t tid;
-    
-    /* wait for a thead to die */
-    while(!zombies)
-        lwp_yield();
 
-    /* grab the undead thread off the list and update the list */
-    zombie = zombies;
-    zombies = zombies->lib_one;
+    /* it may still be switching away on another worker */
+    if(nworkers > 1)
+        while(__atomic_load_n(&zombie->oncpu, __ATOMIC_ACQUIRE))
+            __builtin_ia32_pause();
 
     /* save the id */
     tid = zombie->tid;
+    TRACE(TR_WAIT, lwp_gettid(), tid);
 
     /* save the status */
     if(status)
         *status = MKTERMSTAT(LWP_TERM, zombie->status);
 
+    /* anything left on its stack is still there */
+    if(fn)
+        fn(ctx);
+
     /* deallocate it */
+    LIB_LOCK();
     if(zombie->stack)
-        munmap(zombie->stack, zombie->stacksize);
-    free_16(zombie);
+        stack_free(zombie->stack, zombie->stacksize,
+                   zombie->flags & LWP_GUARDED);
+    tid_release(tid);
+    ctx_free(zombie);
+    LIB_UNLOCK();
 
     return tid;
 }
 
 
 /**
- * @brief Causes the LWP package to use the given scheduler to choose the
- *  next process to run. Transfers all threads from the old scheduler
- *  to the new one in next() order. If scheduler is NULL the library
- *  should return to round-robin scheduling.
+ * @brief Starts the LWP system. Converts the calling thread into a LWP
+ *  and lwp_yield()s to whichever thread the scheduler chooses. With more
+ *  than one worker this also starts the other workers' kernel threads.
  * 
- * @param sched scheduler to change to or NULL if no change.
  */
-void lwp_set_scheduler(scheduler sched)
+void lwp_start(void)
 {
-    if(sched)
+    thread new_thread;
+
+    /* create a 16-byte aligned thread */
+    new_thread = ctx_alloc();
+
+    /* set the tid */
+    LIB_LOCK();
+    new_thread->tid = tid_alloc(new_thread);
+
+    /* mark the stack so we don't free it */
+    new_thread->stack = NULL;
+    new_thread->stacksize = 0;
+
+    /* add the thread to the library list */
+    list_push(&lib_tlist, new_thread);
+    lib_live++;
+    LIB_UNLOCK();
+
+    /* Admit the new thread and set is as active */
+    CRIT_ENTER();
+    ActiveScheduler->admit(new_thread);
+    ActiveThread = new_thread;
+    CRIT_EXIT();
+    new_thread->oncpu = TRUE;
+    new_thread->tsc_in = __rdtsc();
+
+    lib_started = TRUE;
+    if(nworkers > 1 && worker_start() < 0)
+    {
+        perror("lwp_start");
+        exit(EXIT_FAILURE);
+    }
+
+    /* throw yourself upon the mercy of the almighty scheduler */
+    lwp_yield();
+}
+
+
+/**
+ * @brief Waits for a thread to terminate, deallocates its
+ *  resources, and reports its termination status if status is non-NULL.
+ *  Returns the tid of the terminated thread or NO_THREAD if the caller
+ *  is the only thread left. The caller is parked, not polling, until a
+ *  thread exits.
+ * 
+ * @param status 
+ * @return tid_t 
+ */
+tid_t lwp_wait(int *status)
+{
+    thread zombie;
+
+    /* wait for a thead to die, then grab the undead thread off the list */
+    LIB_LOCK();
+    while( !(zombie = zombies) )
+    {
+        if(lib_live - spawn_helpers <= 1)
+        {
+            LIB_UNLOCK();
+            return NO_THREAD;
+        }
+        thread_park(&reapers);
+    }
+    list_unlink(&zombies, zombie);
+    lib_zombies--;
+    LIB_UNLOCK();
+
+    return thread_reap(zombie, status, NULL, NULL);
+}
+
+
+/**
+ * @brief Waits for the given thread to terminate, deallocates it and
+ *  reports its termination status if status is non-NULL. The caller is
+ *  parked until that thread exits, and lwp_wait() won't reap it meanwhile.
+ *  Only one thread can join a given thread.
+ * 
+ * @param tid thread to wait for
+ * @param status where to put its termination status, or NULL
+ * @return tid_t tid, or NO_THREAD if there is no such thread, it is the
+ *  caller, or someone else is already joining it
+ */
+tid_t lwp_join(tid_t tid, int *status)
+{
+    return lwp_join_with(tid, status, NULL, NULL);
+}
+
+
+/**
+ * @brief lwp_join() that calls fn(ctx) after the thread has terminated
+ *  but before its stack is freed, so fn can pick up whatever the thread
+ *  left there (such as lwp_create_inplace()'s argument area). fn runs on
+ *  the caller's stack and must not yield.
+ * 
+ * @param tid thread to wait for
+ * @param status where to put its termination status, or NULL
+ * @param fn what to call, or NULL
+ * @param ctx passed to fn
+ * @return tid_t tid, or NO_THREAD as for lwp_join()
+ */
+tid_t lwp_join_with(tid_t tid, int *status, void (*fn)(void *), void *ctx)
+{
+    thread self = ActiveThread;
+    thread t;
+
+    LIB_LOCK();
+    if( !(t = tid_lookup(tid)) || t == self || t->joiner )
+    {
+        LIB_UNLOCK();
+        return NO_THREAD;
+    }
+
+    /* a thread that already exited is sitting on the zombie list */
+    if(LWPTERMINATED(t->status))
+    {
+        list_unlink(&zombies, t);
+        lib_zombies--;
+    }
+    else
+    {
+        t->joiner = self;
+        while(!LWPTERMINATED(t->status))
+            thread_park(NULL);
+    }
+    LIB_UNLOCK();
+
+    return thread_reap(t, status, fn, ctx);
+}
+
+
+/**
+ * @brief Causes the LWP package to use the given scheduler to choose the
+ *  next process to run. Transfers all threads from the old scheduler
+ *  to the new one in next() order. If scheduler is NULL the library
+ *  should return to round-robin scheduling.
+ * 
+ * @param sched scheduler to change to or NULL if no change.
+ */
+void lwp_set_scheduler(scheduler sched)
+{
+    if(sched)
     {
         thread l;
+        int i;
 
         /* migrate the threads to the new scheduler */
+        CRIT_ENTER();
         while( (l = ActiveScheduler->next()) != NO_THREAD)
         {
             ActiveScheduler->remove(l);
             sched->admit(l);
         }
         ActiveScheduler = sched;
+        ActiveHandoff = NULL;
+        for(i = 0; i < HANDOFF_HOOKS; i++)
+            if(handoff_hooks[i].sched == sched)
+                ActiveHandoff = handoff_hooks[i].hook;
+        CRIT_EXIT();
+    }
+
+}
+
+
+/**
+ * @brief Returns the pointer to the current scheduler.
+ * 
+ * @return scheduler 
+ */
+scheduler lwp_get_scheduler(void)
+{
+    return ActiveScheduler;
+}
+
+
+/**
+ * @brief Registers a hook that lwp_yield_to() and channel rendezvous call,
+ *  in place of remove() and admit(), when they run a thread the scheduler's
+ *  next() didn't pick. A scheduler that charges the running thread for its
+ *  time uses it to start charging t. Passing a NULL hook unregisters it.
+ * 
+ * @param sched the scheduler the hook belongs to
+ * @param hook called with the thread about to run, with the lock held
+ * @return int 0, or -1 if sched is NULL or there's no room for another
+ */
+int lwp_set_handoff_hook(scheduler sched, void (*hook)(thread t))
+{
+    int i, slot = -1;
+
+    if(!sched)
+        return -1;
+
+    CRIT_ENTER();
+    for(i = HANDOFF_HOOKS - 1; i >= 0; i--)
+        if(handoff_hooks[i].sched == sched ||
+                (slot < 0 && !handoff_hooks[i].sched))
+            slot = i;
+    if(slot >= 0)
+    {
+        handoff_hooks[slot].sched = sched;
+        handoff_hooks[slot].hook = hook;
+        if(sched == ActiveScheduler)
+            ActiveHandoff = hook;
+    }
+    CRIT_EXIT();
+
+    return slot < 0 ? -1 : 0;
+}
+
+
+/**
+ * @brief Sets how many freed stacks of each size are kept for reuse.
+ *  Stacks beyond the new cap are unmapped. A cap of zero turns pooling off.
+ * 
+ * @param cap stacks to keep per size
+ */
+void lwp_set_stackpool(unsigned int cap)
+{
+    unsigned long *stack;
+    int i;
+
+    /* the pool is shared with stack_alloc()/stack_free() on every worker */
+    LIB_LOCK();
+    pool_cap = cap;
+    for(i = 0; i < POOL_SIZES; i++)
+    {
+        while(pool[i].count > cap)
+        {
+            stack = pool[i].head;
+            pool[i].head = (unsigned long *) stack[pool[i].size / sizeof(unsigned long) - 1];
+            pool[i].count--;
+            pool_stats.pooled--;
+            munmap(stack, pool[i].size);
+        }
+    }
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Marks a thread as using the FPU, so its whole register file and
+ *  x87/SSE state are saved and restored on every switch. Threads are
+ *  unmarked by default and only keep the FPU control words. With XSAVE
+ *  the first marking gives the thread an area for the extended state,
+ *  which it then keeps until it is freed.
+ * 
+ * @param tid thread to mark
+ * @param on TRUE to save its full FPU state
+ * @return int 0 on success, -1 if there is no such thread or no memory
+ *  for its XSAVE area
+ */
+int lwp_set_fpu(tid_t tid, int on)
+{
+    thread t;
+    void *area = NULL;
+
+    if( !(t = tid2thread(tid)) )
+        return -1;
+
+    if(on)
+    {
+        LIB_LOCK();
+        if(xsave_size && !t->state.xsave && !(area = xsave_alloc()) )
+        {
+            LIB_UNLOCK();
+            return -1;
+        }
+        LIB_UNLOCK();
+
+        /* start from the thread's control words and an empty header, so
+           the first XRSTOR puts every component in its initial state */
+        if(area)
+        {
+            memset(area, 0, xsave_size);
+            memcpy(area, &t->state.fxsave, sizeof(struct fxsave));
+            t->state.xsave = area;
+        }
+        t->flags |= LWP_FPU;
+    }
+    else
+        t->flags &= ~LWP_FPU;
+    return 0;
+}
+
+
+/**
+ * @brief Changes a thread's priority. A queued thread is taken out of the
+ *  scheduler and put back so the scheduler sees the new value; under round
+ *  robin that just sends it to the back of the line. With several workers
+ *  each one has its own queues, so only the calling thread can be changed.
+ * 
+ * @param tid thread to change
+ * @param prio new priority, 0 (most urgent) to LWP_PRIO_LEVELS-1
+ * @return int 0 on success, -1 if there is no such thread or prio is bad
+ */
+int lwp_set_priority(tid_t tid, unsigned int prio)
+{
+    thread t;
+
+    if(prio >= LWP_PRIO_LEVELS || !(t = tid2thread(tid)))
+        return -1;
+    if(nworkers > 1 && t != ActiveThread)
+        return -1;
+
+    /* parked threads get readmitted with the new value when woken */
+    CRIT_ENTER();
+    if(LWPTERMINATED(t->status) || (t->flags & LWP_PARKED))
+        t->priority = prio;
+    else
+    {
+        ActiveScheduler->remove(t);
+        t->priority = prio;
+        ActiveScheduler->admit(t);
+    }
+    CRIT_EXIT();
+    return 0;
+}
+
+
+/**
+ * @brief Returns a thread's priority
+ * 
+ * @param tid thread to look at
+ * @return int its priority or -1 if there is no such thread
+ */
+int lwp_get_priority(tid_t tid)
+{
+    thread t;
+
+    if( !(t = tid2thread(tid)) )
+        return -1;
+    return t->priority;
+}
+
+
+/**
+ * @brief Sets a thread's weight for proportional share schedulers. A
+ *  thread with twice the weight of another gets twice the CPU time.
+ *  Takes effect from the thread's next time slice.
+ * 
+ * @param tid thread to change
+ * @param weight new weight, LWP_WEIGHT_DEFAULT being a normal share
+ * @return int 0 on success, -1 if there is no such thread or weight is 0
+ */
+int lwp_set_weight(tid_t tid, unsigned int weight)
+{
+    thread t;
+
+    if(!weight || !(t = tid2thread(tid)))
+        return -1;
+    t->weight = weight;
+    return 0;
+}
+
+
+/**
+ * @brief Turns the guard page under newly mapped stacks on or off. Guards
+ *  make a stack overflow fault instead of running into whatever is mapped
+ *  below, but each one costs the process a separate memory mapping, so
+ *  programs that need more threads than vm.max_map_count/2 can turn them off.
+ * 
+ * @param on TRUE to guard new stacks
+ */
+void lwp_set_stackguard(int on)
+{
+    stack_guard = on;
+}
+
+
+/**
+ * @brief Copies out the stack pool counters
+ * 
+ * @param stats where to put them
+ */
+void lwp_stackpool_stats(lwp_poolstats *stats)
+{
+    if(stats)
+        *stats = pool_stats;
+}
+
+
+/**
+ * @brief Reads a thread's counters. For the calling thread the cycles
+ *  include the current run.
+ * 
+ * @param tid the thread
+ * @param stats where to put them
+ * @return int 0 on success, -1 if there is no such thread
+ */
+int lwp_stats(tid_t tid, lwp_threadstats *stats)
+{
+    thread t;
+
+    LIB_LOCK();
+    if( !(t = tid_lookup(tid)) )
+    {
+        LIB_UNLOCK();
+        return -1;
+    }
+    *stats = t->stats;
+    if(t == ActiveThread && t->tsc_in)
+        stats->cycles += __rdtsc() - t->tsc_in;
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Takes a snapshot of the library as a whole. Runnable threads
+ *  include the ones running right now.
+ * 
+ * @param stats where to put it
+ */
+void lwp_global_stats(lwp_globalstats *stats)
+{
+    LIB_LOCK();
+    stats->threads = lib_live;
+    stats->runnable = lib_live - lib_parked;
+    stats->parked = lib_parked;
+    stats->zombies = lib_zombies;
+    stats->timers = tw_count;
+    stats->io_waiting = io_waiting;
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Returns the thread corresponding to the given thread ID, or NULL
+ *  if the ID is invalid. The tid indexes straight into the tid table, so
+ *  this is constant time no matter how many threads exist.
+ * 
+ * @param tid id of the thread we want
+ * @return thread
+ */
+thread tid2thread(tid_t tid)
+{
+    thread t;
+
+    LIB_LOCK();
+    t = tid_lookup(tid);
+    LIB_UNLOCK();
+    return t;
+}
+
+/******************************************************************************/
+/* Multi-worker runtime */
+
+/**
+ * @brief Runs LWPs on n kernel threads instead of one. Must be called
+ *  before lwp_start() and before any threads are created. Each worker
+ *  drives its own instance of the active scheduler, so a scheduler used
+ *  with more than one worker has to keep its state in __thread variables
+ *  the way the built-in round robin does.
+ * 
+ * @param n number of workers
+ * @return int 0 on success, -1 if the library has already started
+ */
+int lwp_set_workers(unsigned int n)
+{
+    worker *w;
+    unsigned int i;
+
+    if(lib_started || lib_live || preempt_on || n == 0)
+        return -1;
+    if(n == nworkers)
+        return 0;
+
+    if(workers)
+        munmap(workers, nworkers * sizeof(worker));
+    workers = NULL;
+    nworkers = 1;
+    if(n == 1)
+        return 0;
+
+    w = mmap(NULL, n * sizeof(worker), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(w == MAP_FAILED)
+        return -1;
+    for(i = 0; i < n; i++)
+        w[i].seed = i * 0x9e3779b97f4a7c15UL + 1;
+
+    workers = w;
+    nworkers = n;
+    return 0;
+}
+
+
+/**
+ * @brief Makes a new (or woken) thread runnable. With several workers it
+ *  goes on the bottom of this worker's deque, where the worker will pick
+ *  it up or an idle one can steal it; if the deque is full it is admitted
+ *  to this worker's scheduler directly.
+ * 
+ * @param t the thread
+ */
+static void make_runnable(thread t)
+{
+    cldeque *d;
+    long b;
+
+    TRACE(TR_ADMIT, t->tid, 0);
+    if(nworkers == 1)
+    {
+        CRIT_ENTER();
+        ActiveScheduler->admit(t);
+        CRIT_EXIT();
+        return;
+    }
+
+    /* before lwp_start() the caller is about to become worker 0 */
+    d = Self ? &Self->deque : &workers[0].deque;
+
+    b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    if(b - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= CL_SIZE)
+    {
+        ActiveScheduler->admit(t);
+        return;
+    }
+    __atomic_store_n(&d->buf[b & (CL_SIZE - 1)], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Owner end of the Chase-Lev deque: takes the newest thread
+ * 
+ * @param d this worker's deque
+ * @return thread the thread or NULL if the deque is empty
+ */
+static thread cl_pop(cldeque *d)
+{
+    long b, t;
+    thread x = NULL;
+
+    b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if(t <= b)
+    {
+        x = __atomic_load_n(&d->buf[b & (CL_SIZE - 1)], __ATOMIC_RELAXED);
+        if(t == b)
+        {
+            /* last one: race the thieves for it */
+            if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, FALSE,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                x = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
     }
+    else
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return x;
+}
+
+
+/**
+ * @brief Thief end of the Chase-Lev deque: takes the oldest thread
+ * 
+ * @param d a victim's deque
+ * @return thread the thread or NULL if it was empty or we lost a race
+ */
+static thread cl_steal(cldeque *d)
+{
+    long t, b;
+    thread x;
+
+    t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if(t >= b)
+        return NULL;
+
+    x = __atomic_load_n(&d->buf[t & (CL_SIZE - 1)], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, FALSE,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return x;
+}
+
+
+/**
+ * @brief Picks the next thread for this worker. One fresh thread moves from
+ *  our deque into our scheduler per call, so the rest stay stealable; when
+ *  the scheduler has nothing we go steal from the other workers.
+ * 
+ * @return thread the thread to run or NULL if there is no work anywhere
+ */
+static thread worker_next(void)
+{
+    worker *w = Self;
+    thread t;
+    unsigned int i, v;
+
+    if( (t = cl_pop(&w->deque)) )
+        ActiveScheduler->admit(t);
+    if( (t = ActiveScheduler->next()) )
+        return t;
+
+    /* start at a random victim so thieves spread out */
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    for(i = 0, v = w->seed % nworkers; i < nworkers; i++, v = (v + 1) % nworkers)
+    {
+        if(&workers[v] != w && (t = cl_steal(&workers[v].deque)) )
+        {
+            ActiveScheduler->admit(t);
+            return ActiveScheduler->next();
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Clears the oncpu mark of the thread we just switched away from, now
+ *  that its registers are saved. Runs first thing in whatever context a
+ *  switch lands in.
+ */
+static void finish_switch(void)
+{
+    thread prev = LastThread;
+
+    if(prev)
+    {
+        LastThread = NULL;
+        __atomic_store_n(&prev->oncpu, FALSE, __ATOMIC_RELEASE);
+    }
+}
+
+
+/**
+ * @brief Called by lwp_start() on what becomes worker 0. Worker 0's idle
+ *  loop needs a stack of its own since the caller's stack belongs to the
+ *  original thread; the other workers idle on their pthread stacks.
+ * 
+ * @return int 0 on success, -1 if a worker couldn't be started
+ */
+static int worker_start(void)
+{
+    unsigned int i;
+
+    Self = &workers[0];
+    if( !(Self->idle = thread_new(worker_idle, NULL, IDLE_STACK, 0)) )
+        return -1;
+
+    for(i = 1; i < nworkers; i++)
+        if(pthread_create(&workers[i].pthread, NULL, worker_main, &workers[i]))
+            return -1;
+    return 0;
+}
+
+
+/**
+ * @brief Entry point of the kernel threads for workers 1..n-1. The calling
+ *  kernel thread becomes the worker's idle context.
+ * 
+ * @param arg this worker
+ * @return void* never returns
+ */
+static void *worker_main(void *arg)
+{
+    Self = arg;
+    if( !(Self->idle = ctx_alloc()) )
+        return NULL;
+    Self->idle->oncpu = TRUE;
+    ActiveThread = Self->idle;
+
+    worker_idle(NULL);
+    return NULL;
+}
+
+
+/**
+ * @brief A worker's idle loop: runs whatever worker_next() finds, checks for
+ *  timers and I/O, and naps, backing off up to IDLE_MAXNAP or until the
+ *  next timer, while there is nothing. When the last
+ *  thread exits, the worker it exits on ends the process.
+ * 
+ * @param arg not used
+ * @return int never returns
+ */
+static int worker_idle(void *arg)
+{
+    struct timespec nap = {0, 0}, sleep;
+    unsigned long now;
+    thread t;
+
+    for(;;)
+    {
+        if(tw_count)
+            timer_run();
+        if( (t = worker_next()) )
+        {
+            nap.tv_nsec = 0;
+            CRIT_ENTER();
+            lwp_yield_helper(Self->idle, t);
+            CRIT_EXIT();
+            continue;
+        }
+
+        /* threads that became ready are on our deque now */
+        if(io_waiting && io_poll(0))
+            continue;
+
+        if(nap.tv_nsec < IDLE_MAXNAP)
+            nap.tv_nsec = nap.tv_nsec ? nap.tv_nsec * 2 : 1000;
+
+        /* but not past the next timer */
+        sleep = nap;
+        if(tw_count && (now = clock_ns()) < tw_due << TW_SHIFT &&
+                (tw_due << TW_SHIFT) - now < nap.tv_nsec)
+            sleep.tv_nsec = (tw_due << TW_SHIFT) - now;
+        nanosleep(&sleep, NULL);
+    }
+    return 0;
+}
+
+
+/******************************************************************************/
+/* Preemption */
+
+/**
+ * @brief Turns on time slicing: every quantum_ns of CPU time a SIGALRM
+ *  switches to the next thread, whether or not the running one yields.
+ *  A quantum of 0 turns it back off. Ticks are counted from when this is
+ *  called, not from the last switch, so a thread that yielded just before
+ *  a tick gets a short first slice. Only works with a single worker.
+ * 
+ * @param quantum_ns length of a time slice in nanoseconds, or 0
+ * @return int 0 on success, -1 on failure
+ */
+int lwp_set_preempt(unsigned long quantum_ns)
+{
+    struct sigaction act;
+    struct sigevent sev;
+    struct itimerspec its;
+
+    if(nworkers > 1)
+        return -1;
+
+    if(!quantum_ns)
+    {
+        if(preempt_on)
+        {
+            timer_delete(preempt_timer);
+            sigaction(SIGALRM, &preempt_oldact, NULL);
+            preempt_on = FALSE;
+        }
+        return 0;
+    }
+
+    if(!preempt_on)
+    {
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = preempt_tick;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        if(sigaction(SIGALRM, &act, &preempt_oldact) < 0)
+            return -1;
+
+        /* CPU time, so a kernel thread blocked in a syscall isn't ticked */
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = SIGALRM;
+        if(timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &preempt_timer) < 0)
+        {
+            sigaction(SIGALRM, &preempt_oldact, NULL);
+            return -1;
+        }
+        preempt_on = TRUE;
+    }
+
+    its.it_value.tv_sec = quantum_ns / 1000000000UL;
+    its.it_value.tv_nsec = quantum_ns % 1000000000UL;
+    its.it_interval = its.it_value;
+    return timer_settime(preempt_timer, 0, &its, NULL);
+}
+
+
+/**
+ * @brief Keeps the calling thread from being preempted until the matching
+ *  lwp_preempt_enable(). Calls nest. Needed around code that isn't safe to
+ *  interrupt and re-enter from another thread, like holding a lock that
+ *  other threads take. Plain calls into shared libraries (libc's malloc
+ *  and stdio included) are never preempted, so they don't need it.
+ */
+void lwp_preempt_disable(void)
+{
+    CRIT_ENTER();
+}
+
+
+/**
+ * @brief Ends a lwp_preempt_disable(). If a tick came in meanwhile the
+ *  thread yields here.
+ */
+void lwp_preempt_enable(void)
+{
+    CRIT_EXIT();
+}
+
+
+/**
+ * @brief Tells whether the interrupted code is in the program itself. Code
+ *  in shared libraries (libc, the vDSO) may hold locks or state we'd
+ *  re-enter from the next thread, so the tick waits for it to return.
+ * 
+ * @param uctx context the signal interrupted
+ * @return int TRUE if it is safe to switch threads here
+ */
+static int preempt_safe(void *uctx)
+{
+    extern char __executable_start[], etext[];
+    char *pc = (char *) ((ucontext_t *) uctx)->uc_mcontext.gregs[REG_RIP];
+
+    return pc >= __executable_start && pc < etext;
+}
+
+
+/**
+ * @brief SIGALRM handler. Switches from inside the handler: the kernel has
+ *  already saved the full register file and FPU state of the interrupted
+ *  thread in the signal frame on its stack, so the lean switch is enough,
+ *  and the thread resumes by returning from here through sigreturn.
+ *  SIGALRM is unblocked before switching since the thread we switch to
+ *  may not return through a handler to restore the mask.
+ * 
+ * @param sig SIGALRM
+ * @param info not used
+ * @param uctx interrupted context
+ */
+static void preempt_tick(int sig, siginfo_t *info, void *uctx)
+{
+    sigset_t set;
+    int saved_errno;
+
+    /* ticks can land on other kernel threads the program created */
+    if(!ActiveThread)
+        return;
+    if(preempt_off || !preempt_safe(uctx))
+    {
+        preempt_pending = TRUE;
+        return;
+    }
+
+    saved_errno = errno;
+    preempt_off++;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+    preempting = TRUE;
+    lwp_resched();
+
+    preempt_off--;
+    errno = saved_errno;
+}
+
+
+/**
+ * @brief Yields for a tick that came in during a critical section
+ */
+static void preempt_now(void)
+{
+    preempt_pending = FALSE;
+    if(preempt_on && ActiveThread)
+    {
+        preempting = TRUE;
+        lwp_yield();
+    }
+}
+
+
+/******************************************************************************/
+/* Synchronization */
+
+/* A mutex's state is 0 when free, 1 when held and 2 when held with threads
+   (possibly) parked on it. Taking a free mutex and releasing one nobody is
+   waiting for are a single atomic instruction each; only contention takes
+   the library lock and touches the scheduler. */
+
+/**
+ * @brief Initializes a mutex to unlocked. LWP_MUTEX_INITIALIZER does the
+ *  same statically.
+ * 
+ * @param m the mutex
+ */
+void lwp_mutex_init(lwp_mutex *m)
+{
+    m->state = 0;
+    m->waiters.head = NULL;
+    m->waiters.tail = NULL;
+}
+
+
+/**
+ * @brief Locks a mutex, parking the calling thread until it is free
+ * 
+ * @param m the mutex
+ */
+void lwp_mutex_lock(lwp_mutex *m)
+{
+    unsigned int c = 0;
+
+    if(__atomic_compare_exchange_n(&m->state, &c, 1, FALSE,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    /* mark it contended so the holder's unlock comes looking for us */
+    LIB_LOCK();
+    while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+        thread_park(&m->waiters);
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Locks a mutex, parking the calling thread until it is free or
+ *  timeout_ns have gone by
+ * 
+ * @param m the mutex
+ * @param timeout_ns how long to wait, in nanoseconds
+ * @return int 0 if we got it, -1 if the time ran out
+ */
+int lwp_mutex_timedlock(lwp_mutex *m, unsigned long timeout_ns)
+{
+    unsigned long deadline;
+    unsigned int c = 0;
+
+    if(__atomic_compare_exchange_n(&m->state, &c, 1, FALSE,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    /* leaving the mutex marked contended is harmless; the next unlock
+       just finds nobody to wake */
+    deadline = clock_ns() + timeout_ns;
+    LIB_LOCK();
+    while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+        if(thread_park_until(&m->waiters, deadline) < 0)
+        {
+            LIB_UNLOCK();
+            return -1;
+        }
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Locks a mutex if it is free
+ * 
+ * @param m the mutex
+ * @return int 0 if we got it, -1 if it is held
+ */
+int lwp_mutex_trylock(lwp_mutex *m)
+{
+    unsigned int c = 0;
+
+    return __atomic_compare_exchange_n(&m->state, &c, 1, FALSE,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+
+/**
+ * @brief Unlocks a mutex and wakes one thread waiting for it, if any. The
+ *  woken thread competes for the mutex like anyone else.
+ * 
+ * @param m the mutex
+ */
+void lwp_mutex_unlock(lwp_mutex *m)
+{
+    if(__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 1)
+        return;
+
+    LIB_LOCK();
+    mutex_wake(m);
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Initializes a condition variable. LWP_COND_INITIALIZER does the
+ *  same statically.
+ * 
+ * @param c the condition variable
+ */
+void lwp_cond_init(lwp_cond *c)
+{
+    c->waiters.head = NULL;
+    c->waiters.tail = NULL;
+}
+
+
+/**
+ * @brief Unlocks m and parks until the condition is signalled, then locks
+ *  m again. We are queued on the condition before m is released, so a
+ *  signal sent by whoever takes m next can't be missed. Wakeups can still
+ *  be stale by the time m is ours, so callers recheck their condition.
+ * 
+ * @param c the condition variable
+ * @param m a mutex the caller holds
+ */
+void lwp_cond_wait(lwp_cond *c, lwp_mutex *m)
+{
+    LIB_LOCK();
+    waitq_push(&c->waiters, ActiveThread);
+    if(__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) != 1)
+        mutex_wake(m);
+    thread_park(NULL);
+    LIB_UNLOCK();
+
+    lwp_mutex_lock(m);
+}
+
+
+/**
+ * @brief lwp_cond_wait() that gives up after timeout_ns. m is locked again
+ *  either way.
+ * 
+ * @param c the condition variable
+ * @param m a mutex the caller holds
+ * @param timeout_ns how long to wait, in nanoseconds
+ * @return int 0 if signalled, -1 if the time ran out
+ */
+int lwp_cond_timedwait(lwp_cond *c, lwp_mutex *m, unsigned long timeout_ns)
+{
+    unsigned long deadline = clock_ns() + timeout_ns;
+    int res;
+
+    LIB_LOCK();
+    waitq_push(&c->waiters, ActiveThread);
+    if(__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) != 1)
+        mutex_wake(m);
+    res = thread_park_until(NULL, deadline);
+    LIB_UNLOCK();
+
+    lwp_mutex_lock(m);
+    return res;
+}
+
+
+/**
+ * @brief Wakes one thread waiting on a condition variable
+ * 
+ * @param c the condition variable
+ */
+void lwp_cond_signal(lwp_cond *c)
+{
+    thread t;
+
+    if(!__atomic_load_n(&c->waiters.head, __ATOMIC_ACQUIRE))
+        return;
+
+    LIB_LOCK();
+    if( (t = waitq_pop(&c->waiters)) )
+        thread_wake(t);
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Wakes every thread waiting on a condition variable
+ * 
+ * @param c the condition variable
+ */
+void lwp_cond_broadcast(lwp_cond *c)
+{
+    thread t;
+
+    if(!__atomic_load_n(&c->waiters.head, __ATOMIC_ACQUIRE))
+        return;
+
+    LIB_LOCK();
+    while( (t = waitq_pop(&c->waiters)) )
+        thread_wake(t);
+    LIB_UNLOCK();
+}
+
+
+/* A semaphore's count goes negative by the number of threads that are in
+   (or headed for) the slow path of lwp_sem_wait(). A post that finds it
+   negative hands its unit straight to a parked waiter, or leaves it in
+   wakeups for a waiter that hasn't parked yet. A waiter that times out
+   after a post has already counted it takes the unit anyway, ahead of
+   that post reaching wakeups, which can leave wakeups below zero. */
+
+/**
+ * @brief Initializes a semaphore. LWP_SEM_INITIALIZER(value) does the same
+ *  statically.
+ * 
+ * @param sem the semaphore
+ * @param value starting count
+ */
+void lwp_sem_init(lwp_sem *sem, unsigned int value)
+{
+    sem->count = value;
+    sem->wakeups = 0;
+    sem->waiters.head = NULL;
+    sem->waiters.tail = NULL;
+}
+
+
+/**
+ * @brief Takes a unit from the semaphore, parking until one is posted if
+ *  there are none
+ * 
+ * @param sem the semaphore
+ */
+void lwp_sem_wait(lwp_sem *sem)
+{
+    if(__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0)
+        return;
+
+    LIB_LOCK();
+    if(sem->wakeups > 0)
+        sem->wakeups--;
+    else
+        thread_park(&sem->waiters);    /* the poster hands us its unit */
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief lwp_sem_wait() that gives up after timeout_ns
+ * 
+ * @param sem the semaphore
+ * @param timeout_ns how long to wait, in nanoseconds
+ * @return int 0 if we got a unit, -1 if the time ran out
+ */
+int lwp_sem_timedwait(lwp_sem *sem, unsigned long timeout_ns)
+{
+    unsigned long deadline;
+    long c;
+
+    if(__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0)
+        return 0;
+
+    deadline = clock_ns() + timeout_ns;
+    LIB_LOCK();
+    if(sem->wakeups > 0)
+        sem->wakeups--;
+    else if(thread_park_until(&sem->waiters, deadline) < 0)
+    {
+        /* back out of the count, unless posts already cover every waiter
+           including us, in which case one of them is on its way here */
+        c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+        do
+        {
+            if(c >= 0)
+            {
+                sem->wakeups--;
+                LIB_UNLOCK();
+                return 0;
+            }
+        } while(!__atomic_compare_exchange_n(&sem->count, &c, c + 1, FALSE,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        LIB_UNLOCK();
+        return -1;
+    }
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Takes a unit from the semaphore if there is one
+ * 
+ * @param sem the semaphore
+ * @return int 0 if we got one, -1 if the count was zero
+ */
+int lwp_sem_trywait(lwp_sem *sem)
+{
+    long c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+    while(c > 0)
+        if(__atomic_compare_exchange_n(&sem->count, &c, c - 1, FALSE,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+    return -1;
+}
+
+
+/**
+ * @brief Posts a unit to the semaphore, waking a waiter if there is one
+ * 
+ * @param sem the semaphore
+ */
+void lwp_sem_post(lwp_sem *sem)
+{
+    thread t;
+
+    if(__atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE) >= 0)
+        return;
+
+    LIB_LOCK();
+    if( (t = waitq_pop(&sem->waiters)) )
+        thread_wake(t);
+    else
+        sem->wakeups++;
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Wakes the first thread parked on a mutex. The library is locked.
+ * 
+ * @param m the mutex
+ */
+static void mutex_wake(lwp_mutex *m)
+{
+    thread t;
+
+    if( (t = waitq_pop(&m->waiters)) )
+        thread_wake(t);
+}
+
+
+/******************************************************************************/
+/* Channels */
+
+/**
+ * @brief Makes a channel that carries pointers. With a capacity of 0 it is
+ *  unbuffered: every send waits for a receiver. Otherwise up to cap
+ *  messages queue up before senders block.
+ * 
+ * @param cap number of messages the channel buffers
+ * @return lwp_chan* the channel or NULL if malloc failed
+ */
+lwp_chan *lwp_chan_create(unsigned int cap)
+{
+    lwp_chan *c;
+
+    /* smartalloc's table isn't safe to preempt */
+    CRIT_ENTER();
+    c = malloc(sizeof(struct lwp_chan) + cap * sizeof(void *));
+    CRIT_EXIT();
+    if(!c)
+        return NULL;
+    memset(c, 0, sizeof(struct lwp_chan));
+    c->buf = (void **) (c + 1);
+    c->cap = cap;
+    return c;
+}
+
+
+/**
+ * @brief Closes a channel. Sends on it fail from now on, and receives fail
+ *  once the messages already buffered are gone. Threads blocked on it are
+ *  woken with a failure.
+ * 
+ * @param c the channel
+ */
+void lwp_chan_close(lwp_chan *c)
+{
+    chanwait *w;
+
+    LIB_LOCK();
+    c->closed = TRUE;
+    while( (w = chanq_take(&c->receivers)) )
+    {
+        w->msg = NULL;
+        chan_fire(w, -1);
+    }
+    while( (w = chanq_take(&c->senders)) )
+        chan_fire(w, -1);
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Frees a channel. Nobody may be blocked on it or use it afterwards.
+ * 
+ * @param c the channel
+ */
+void lwp_chan_destroy(lwp_chan *c)
+{
+    CRIT_ENTER();
+    free(c);
+    CRIT_EXIT();
+}
+
+
+/**
+ * @brief Sends a message, blocking while the channel is full (or, when it
+ *  is unbuffered, until a receiver takes it). The pointer itself is what
+ *  gets delivered. If a receiver is already waiting it gets the message
+ *  directly, and on an unbuffered channel it runs next.
+ * 
+ * @param c the channel
+ * @param msg the message
+ * @return int 0 on success, -1 if the channel is closed
+ */
+int lwp_chan_send(lwp_chan *c, void *msg)
+{
+    lwp_chan_op op;
+
+    op.chan = c;
+    op.send = TRUE;
+    op.msg = msg;
+    lwp_chan_select(&op, 1, TRUE);
+    return op.result;
+}
+
+
+/**
+ * @brief Receives a message, blocking until there is one
+ * 
+ * @param c the channel
+ * @param msg where to put the message
+ * @return int 0 on success, -1 if the channel is closed and drained
+ */
+int lwp_chan_recv(lwp_chan *c, void **msg)
+{
+    lwp_chan_op op;
+
+    op.chan = c;
+    op.send = FALSE;
+    lwp_chan_select(&op, 1, TRUE);
+    if(msg)
+        *msg = op.msg;
+    return op.result;
+}
+
+
+/**
+ * @brief Performs whichever one of several sends and receives can go first.
+ *  Ready operations are tried starting from a rotating position so no case
+ *  starves. If none is ready the caller either parks on all of the
+ *  channels at once or, when block is FALSE, returns straight away. The
+ *  operation that completes gets its result set (and msg, for a receive);
+ *  a closed channel counts as ready with a result of -1.
+ * 
+ * @param ops the operations
+ * @param n number of operations
+ * @param block TRUE to wait for one to be ready
+ * @return int index of the operation performed, or -1 if none was ready
+ *  and block is FALSE
+ */
+int lwp_chan_select(lwp_chan_op *ops, int n, int block)
+{
+    return chan_select(ops, n, block, 0);
+}
+
+
+/**
+ * @brief lwp_chan_select() that waits at most timeout_ns for an operation
+ *  to be ready
+ * 
+ * @param ops the operations
+ * @param n number of operations
+ * @param timeout_ns how long to wait, in nanoseconds
+ * @return int index of the operation performed, or -1 if the time ran out
+ */
+int lwp_chan_timedselect(lwp_chan_op *ops, int n, unsigned long timeout_ns)
+{
+    return chan_select(ops, n, TRUE, clock_ns() + timeout_ns);
+}
+
+
+/**
+ * @brief Does the work of the selects
+ * 
+ * @param ops the operations
+ * @param n number of operations
+ * @param block TRUE to wait for one to be ready
+ * @param deadline when to stop waiting, or 0 for never
+ * @return int index of the operation performed, or -1 if none was
+ */
+static int chan_select(lwp_chan_op *ops, int n, int block,
+    unsigned long deadline)
+{
+    thread to = NULL;
+    int i, k, done;
+
+    if(n <= 0)
+        return -1;
+
+    LIB_LOCK();
+    i = n > 1 ? chan_seed++ % n : 0;
+    for(k = 0; k < n; k++, i = i + 1 < n ? i + 1 : 0)
+    {
+        if(ops[i].send)
+            done = chan_try_send(ops[i].chan, ops[i].msg, &ops[i].result, &to);
+        else
+            done = chan_try_recv(ops[i].chan, &ops[i].msg, &ops[i].result);
+        if(done)
+            break;
+    }
+
+    if(k == n)
+        i = block ? chan_park(ops, n, deadline) : -1;
+    /* an unbuffered send is a rendezvous, so the receiver that took our
+       message runs next. Buffered sends carry on, which streams better
+       than switching on every message. With several workers the receiver
+       is left for the scheduler, since it is now in a deque another
+       worker could steal it from */
+    else if(to && nworkers == 1)
+    {
+        sched_handoff(to);
+        lwp_yield_helper(ActiveThread, to);
+    }
+    LIB_UNLOCK();
+
+    return i;
+}
+
+
+/**
+ * @brief Completes a send if it can be done without blocking: straight to a
+ *  parked receiver, or into the buffer. Library locked.
+ * 
+ * @param c the channel
+ * @param msg the message
+ * @param res set to 0, or -1 if the channel is closed
+ * @param to set to the receiver that was handed the message, if it should
+ *  run straight away
+ * @return int TRUE if the send is done, FALSE if it has to wait
+ */
+static int chan_try_send(lwp_chan *c, void *msg, int *res, thread *to)
+{
+    chanwait *w;
+    unsigned int i;
+
+    if(c->closed)
+    {
+        *res = -1;
+        return TRUE;
+    }
+
+    if( (w = chanq_take(&c->receivers)) )
+    {
+        w->msg = msg;
+        chan_fire(w, 0);
+        if(!c->cap)
+            *to = w->sel->t;
+    }
+    else if(c->count < c->cap)
+    {
+        if( (i = c->head + c->count++) >= c->cap )
+            i -= c->cap;
+        c->buf[i] = msg;
+    }
+    else
+        return FALSE;
+
+    *res = 0;
+    return TRUE;
+}
+
+
+/**
+ * @brief Completes a receive if it can be done without blocking: from the
+ *  buffer (refilled from a parked sender), straight from a parked sender,
+ *  or as a failure on a closed channel. Library locked.
+ * 
+ * @param c the channel
+ * @param msg where to put the message
+ * @param res set to 0, or -1 if the channel is closed and drained
+ * @return int TRUE if the receive is done, FALSE if it has to wait
+ */
+static int chan_try_recv(lwp_chan *c, void **msg, int *res)
+{
+    chanwait *w;
+    unsigned int i;
+
+    *res = 0;
+    if(c->count)
+    {
+        *msg = c->buf[c->head];
+        if(++c->head == c->cap)
+            c->head = 0;
+        c->count--;
+
+        /* the oldest blocked sender's message takes the freed slot */
+        if( (w = chanq_take(&c->senders)) )
+        {
+            if( (i = c->head + c->count++) >= c->cap )
+                i -= c->cap;
+            c->buf[i] = w->msg;
+            chan_fire(w, 0);
+        }
+        return TRUE;
+    }
+
+    if( (w = chanq_take(&c->senders)) )
+    {
+        *msg = w->msg;
+        chan_fire(w, 0);
+        return TRUE;
+    }
+
+    if(c->closed)
+    {
+        *msg = NULL;
+        *res = -1;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+/**
+ * @brief Parks the caller on every channel in ops until one of them
+ *  completes its operation. Library locked.
+ * 
+ * @param ops the operations
+ * @param n number of operations
+ * @param deadline when to give up, or 0 for never
+ * @return int index of the operation that completed, or -1 if none did
+ *  by the deadline
+ */
+static int chan_park(lwp_chan_op *ops, int n, unsigned long deadline)
+{
+    chanwait waits[n];
+    chansel sel;
+    chanwait *w;
+    int i;
+
+    sel.t = ActiveThread;
+    sel.fired = NULL;
+    for(i = 0; i < n; i++)
+    {
+        waits[i].sel = &sel;
+        waits[i].msg = ops[i].msg;
+        waits[i].index = i;
+        chanq_push(ops[i].send ? &ops[i].chan->senders : &ops[i].chan->receivers,
+            &waits[i]);
+    }
+
+    while(!sel.fired)
+        if(thread_park_until(NULL, deadline) < 0)
+            break;
+
+    /* the other cases are still queued */
+    for(i = 0; i < n; i++)
+        if(waits[i].queued)
+            chanq_unlink(ops[i].send ? &ops[i].chan->senders
+                : &ops[i].chan->receivers, &waits[i]);
+
+    if( !(w = sel.fired) )
+        return -1;
+    ops[w->index].result = w->ok;
+    if(!ops[w->index].send)
+        ops[w->index].msg = w->msg;
+    return w->index;
+}
+
+
+/******************************************************************************/
+/* Blocking I/O */
+
+/**
+ * @brief read(2) that parks the calling thread, rather than the whole
+ *  process, until there is something to read. The fd is switched to
+ *  non-blocking mode the first time, and should be closed with
+ *  lwp_close().
+ * 
+ * @param fd file descriptor
+ * @param buf where to read to
+ * @param count most bytes to read
+ * @return ssize_t bytes read, 0 at end of file, or -1 with errno set
+ */
+ssize_t lwp_read(int fd, void *buf, size_t count)
+{
+    ssize_t n;
+
+    if(io_prepare(fd) < 0)
+        return -1;
+    while((n = read(fd, buf, count)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        if(io_wait(fd, POLLIN, 0) < 0)
+            return -1;
+    return n;
+}
+
+
+/**
+ * @brief write(2) that parks the calling thread until the fd can take more.
+ *  Like write(2) it may write less than count.
+ * 
+ * @param fd file descriptor
+ * @param buf what to write
+ * @param count bytes to write
+ * @return ssize_t bytes written, or -1 with errno set
+ */
+ssize_t lwp_write(int fd, const void *buf, size_t count)
+{
+    ssize_t n;
+
+    if(io_prepare(fd) < 0)
+        return -1;
+    while((n = write(fd, buf, count)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        if(io_wait(fd, POLLOUT, 0) < 0)
+            return -1;
+    return n;
+}
+
+
+/**
+ * @brief accept(2) that parks the calling thread until a connection comes
+ *  in. The new socket is already non-blocking, ready for lwp_read() and
+ *  lwp_write().
+ * 
+ * @param fd listening socket
+ * @param addr where to put the peer's address, or NULL
+ * @param addrlen size of addr, updated to the address's length
+ * @return int the connected socket, or -1 with errno set
+ */
+int lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int conn;
+
+    if(io_prepare(fd) < 0)
+        return -1;
+    while((conn = accept4(fd, addr, addrlen, SOCK_NONBLOCK)) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+        if(io_wait(fd, POLLIN, 0) < 0)
+            return -1;
+
+    if(conn >= 0)
+    {
+        LIB_LOCK();
+        if(io_slot(conn))
+            io_fds[conn].nonblock = TRUE;
+        LIB_UNLOCK();
+    }
+    return conn;
+}
+
+
+/**
+ * @brief Parks the calling thread until an fd is ready for any of events
+ * 
+ * @param fd file descriptor
+ * @param events POLLIN and/or POLLOUT
+ * @return int the ready events, which may include POLLERR or POLLHUP, or
+ *  -1 with errno set
+ */
+int lwp_poll(int fd, short events)
+{
+    return fd_wait(fd, events, 0);
+}
+
+
+/**
+ * @brief lwp_poll() that gives up after timeout_ns
+ * 
+ * @param fd file descriptor
+ * @param events POLLIN and/or POLLOUT
+ * @param timeout_ns how long to wait, in nanoseconds
+ * @return int the ready events, 0 if the time ran out, or -1 with errno set
+ */
+int lwp_timedpoll(int fd, short events, unsigned long timeout_ns)
+{
+    return fd_wait(fd, events, clock_ns() + timeout_ns);
+}
+
+
+/**
+ * @brief Does the work of the polls
+ * 
+ * @param fd file descriptor
+ * @param events POLLIN and/or POLLOUT
+ * @param deadline when to give up, or 0 for never
+ * @return int the ready events, 0 at the deadline, or -1 with errno set
+ */
+static int fd_wait(int fd, short events, unsigned long deadline)
+{
+    struct pollfd p;
+    int n;
+
+    p.fd = fd;
+    p.events = events;
+    while((n = poll(&p, 1, 0)) == 0 || (n < 0 && errno == EINTR))
+        if(io_wait(fd, events, deadline) < 0)
+            return errno == ETIMEDOUT ? 0 : -1;
+    return n < 0 ? -1 : p.revents;
+}
+
+
+/**
+ * @brief close(2) for fds that have been used with the calls above. The
+ *  library forgets the fd, so it is ready for the next one to get that
+ *  number, and any threads still waiting on it wake to an error.
+ * 
+ * @param fd file descriptor
+ * @return int what close(2) returns
+ */
+int lwp_close(int fd)
+{
+    int res;
+
+    /* closed before anyone we wake can run, so they see EBADF rather than
+       waiting again */
+    LIB_LOCK();
+    if(fd >= 0 && fd < io_nfds)
+    {
+        if(io_fds[fd].added)
+            epoll_ctl(io_epfd, EPOLL_CTL_DEL, fd, NULL);
+        io_ready(fd, EPOLLERR);
+        io_fds[fd].nonblock = FALSE;
+        io_fds[fd].added = FALSE;
+    }
+    res = close(fd);
+    LIB_UNLOCK();
+    return res;
+}
+
+
+/**
+ * @brief Puts an fd in non-blocking mode, once, so the calls above can
+ *  try it without blocking the process
+ * 
+ * @param fd file descriptor
+ * @return int 0 on success, -1 with errno set on failure
+ */
+static int io_prepare(int fd)
+{
+    iofd *f;
+    int flags, res = 0;
+
+    LIB_LOCK();
+    if( !(f = io_slot(fd)) )
+        res = -1;
+    else if(!f->nonblock)
+    {
+        if((flags = fcntl(fd, F_GETFL)) < 0 ||
+                (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+            res = -1;
+        else
+            f->nonblock = TRUE;
+    }
+    LIB_UNLOCK();
+    return res;
+}
+
+
+/**
+ * @brief Parks the calling thread until the scheduler's poll finds fd
+ *  ready for events. Whatever was wanted has to be tried again afterwards;
+ *  someone else may have gotten there first.
+ * 
+ * @param fd file descriptor
+ * @param events POLLIN and/or POLLOUT
+ * @param deadline when to give up, or 0 for never
+ * @return int 0 once woken, -1 with errno set if fd can't be waited on or
+ *  (ETIMEDOUT) the deadline passed
+ */
+static int io_wait(int fd, short events, unsigned long deadline)
+{
+    iofd *f;
+    lwp_waitq *q;
+
+    LIB_LOCK();
+    if((io_epfd < 0 && (io_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+            !(f = io_slot(fd)) || io_arm(fd, f, events) < 0)
+    {
+        LIB_UNLOCK();
+        return -1;
+    }
+
+    if(events == POLLIN)
+        q = &f->readers;
+    else if(events == POLLOUT)
+        q = &f->writers;
+    else
+    {
+        q = &f->pollers;
+        f->pollev |= events;
+    }
+
+    /* still locked until we are queued, so the event can't be handled
+       before there is someone to wake */
+    io_waiting++;
+    if(thread_park_until(q, deadline) < 0)
+    {
+        io_waiting--;
+        LIB_UNLOCK();
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Finds the table entry for an fd, growing the table to fit.
+ *  Library locked.
+ * 
+ * @param fd file descriptor
+ * @return iofd* the entry or NULL (errno set) if fd is bad or malloc failed
+ */
+static iofd *io_slot(int fd)
+{
+    iofd *table;
+    int n;
+
+    if(fd < 0)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    if(fd >= io_nfds)
+    {
+        for(n = io_nfds ? io_nfds : 64; n <= fd; n *= 2)
+            ;
+        if( !(table = realloc(io_fds, n * sizeof(iofd))) )
+            return NULL;
+        memset(table + io_nfds, 0, (n - io_nfds) * sizeof(iofd));
+        io_fds = table;
+        io_nfds = n;
+    }
+    return &io_fds[fd];
+}
+
+
+/**
+ * @brief Arms an fd in the epoll instance for one event of whatever its
+ *  waiters want, plus events. Library locked.
+ * 
+ * @param fd file descriptor
+ * @param f its entry
+ * @param events POLLIN and/or POLLOUT for a thread about to wait, or 0
+ * @return int 0 on success, -1 with errno set on failure
+ */
+static int io_arm(int fd, iofd *f, short events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if(f->readers.head)
+        events |= POLLIN;
+    if(f->writers.head)
+        events |= POLLOUT;
+    if(f->pollers.head)
+        events |= f->pollev;
+
+    ev.events = EPOLLONESHOT;
+    if(events & POLLIN)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if(events & POLLOUT)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+
+    /* the kernel drops an fd from the set when it is closed, so our idea
+       of whether it is added can be out of date */
+    op = f->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if(epoll_ctl(io_epfd, op, fd, &ev) < 0)
+    {
+        if(errno != (op == EPOLL_CTL_MOD ? ENOENT : EEXIST))
+            return -1;
+        op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if(epoll_ctl(io_epfd, op, fd, &ev) < 0)
+            return -1;
+    }
+    f->added = TRUE;
+    return 0;
+}
+
+
+/**
+ * @brief Wakes the threads an event on an fd is for, and rearms the fd for
+ *  any that are left. Library locked.
+ * 
+ * @param fd file descriptor
+ * @param events what epoll reported
+ */
+static void io_ready(int fd, unsigned int events)
+{
+    iofd *f = &io_fds[fd];
+    thread t;
+
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+        while( (t = waitq_pop(&f->readers)) )
+        {
+            io_waiting--;
+            thread_wake(t);
+        }
+    if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        while( (t = waitq_pop(&f->writers)) )
+        {
+            io_waiting--;
+            thread_wake(t);
+        }
+    while( (t = waitq_pop(&f->pollers)) )
+    {
+        io_waiting--;
+        thread_wake(t);
+    }
+    f->pollev = 0;
+
+    if(f->readers.head || f->writers.head)
+        io_arm(fd, f, 0);
+}
+
+
+/**
+ * @brief Checks the epoll instance and wakes the threads whose fds are
+ *  ready. Called by the scheduler with no lock held.
+ * 
+ * @param timeout milliseconds to wait for something, or -1 for as long as
+ *  it takes
+ * @return int number of fds that were ready
+ */
+static int io_poll(int timeout)
+{
+    struct epoll_event ev[IO_EVENTS];
+    unsigned long expired;
+    int n, i;
+
+    if((n = epoll_wait(io_epfd, ev, IO_EVENTS, timeout)) <= 0)
+        return 0;
+
+    LIB_LOCK();
+    for(i = 0; i < n; i++)
+    {
+        /* the timer wheel runs after this; just clear the timerfd */
+        if(ev[i].data.fd == tw_fd)
+        {
+            if(read(tw_fd, &expired, sizeof(expired)) < 0)
+                continue;
+        }
+        else if(ev[i].data.fd < io_nfds)
+            io_ready(ev[i].data.fd, ev[i].events);
+    }
+    LIB_UNLOCK();
+    return n;
+}
+
+
+/******************************************************************************/
+/* Timers */
+
+/**
+ * @brief Parks the calling thread for at least ns nanoseconds. Other
+ *  threads run meanwhile, and if there are none the process sleeps.
+ * 
+ * @param ns how long to sleep
+ */
+void lwp_sleep_ns(unsigned long ns)
+{
+    unsigned long deadline = clock_ns() + ns;
+
+    LIB_LOCK();
+    while(thread_park_until(NULL, deadline) == 0)
+        ;
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Arms a thread's timer. Library locked.
+ * 
+ * @param t the thread, about to park
+ * @param deadline CLOCK_MONOTONIC time in ns it should be woken at
+ */
+static void timer_add(thread t, unsigned long deadline)
+{
+    /* a timer with nothing else in the wheels can start it anywhere */
+    if(!tw_count)
+        tw_now = clock_ns() >> TW_SHIFT;
+
+    /* round up so we never wake early */
+    t->deadline = (deadline + (1UL << TW_SHIFT) - 1) >> TW_SHIFT;
+    t->flags |= LWP_TIMED;
+    tw_count++;
+    timer_insert(t);
+}
+
+
+/**
+ * @brief Takes a thread's timer out of the wheels. Library locked.
+ * 
+ * @param t the thread
+ */
+static void timer_cancel(thread t)
+{
+    unsigned int lvl = t->timer_slot / TW_SLOTS, slot = t->timer_slot % TW_SLOTS;
+
+    if(t->timer_prev)
+        t->timer_prev->timer_next = t->timer_next;
+    else if( !(tw_wheel[lvl][slot] = t->timer_next) )
+        tw_used[lvl] &= ~(1UL << slot);
+    if(t->timer_next)
+        t->timer_next->timer_prev = t->timer_prev;
+
+    t->flags &= ~LWP_TIMED;
+    tw_count--;
+}
+
+
+/**
+ * @brief Puts an armed timer in the wheel and slot its deadline belongs in
+ *  as of tw_now. Library locked.
+ * 
+ * @param t the thread
+ */
+static void timer_insert(thread t)
+{
+    unsigned long tick = t->deadline, start;
+    unsigned int lvl = 0, slot;
+
+    if(tick < tw_now)
+        tick = tw_now;
+    if(tick != tw_now)
+        lvl = (63 - __builtin_clzl(tick ^ tw_now)) / TW_BITS;
+
+    /* further out than the wheels reach: wait out this turn of the top
+       wheel, then go back in. The last tick of a turn is never tw_now,
+       which has just been run when we come back here */
+    if(lvl >= TW_LEVELS)
+    {
+        tick = tw_now | ((1UL << (TW_LEVELS * TW_BITS)) - 1);
+        lvl = tick == tw_now ? 0 : (63 - __builtin_clzl(tick ^ tw_now)) / TW_BITS;
+    }
+
+    slot = (tick >> (lvl * TW_BITS)) & (TW_SLOTS - 1);
+    t->timer_slot = lvl * TW_SLOTS + slot;
+    t->timer_prev = NULL;
+    if( (t->timer_next = tw_wheel[lvl][slot]) )
+        t->timer_next->timer_prev = t;
+    tw_wheel[lvl][slot] = t;
+    tw_used[lvl] |= 1UL << slot;
+
+    start = tick >> (lvl * TW_BITS) << (lvl * TW_BITS);
+    if(start < tw_now)
+        start = tw_now;
+    if(start < tw_due)
+        tw_due = start;
+}
+
+
+/**
+ * @brief Wakes a thread whose deadline has come, taking it off the wait
+ *  queue it was parked on. Library locked, timer already out of the
+ *  wheels.
+ * 
+ * @param t the thread
+ */
+static void timer_fire(thread t)
+{
+    t->flags = (t->flags & ~LWP_TIMED) | LWP_TIMEDOUT;
+    if(t->waitq)
+        waitq_remove(t->waitq, t);
+    thread_wake(t);
+}
+
+
+/**
+ * @brief Finds the next tick at which a slot needs running: the first
+ *  occupied slot at or after the current position of each wheel, starting
+ *  no earlier than tw_now. Library locked.
+ * 
+ * @return unsigned long the tick, or TW_NONE if the wheels are empty
+ */
+static unsigned long timer_next(void)
+{
+    unsigned long best = TW_NONE, bits, start;
+    unsigned int lvl, shift;
+
+    for(lvl = 0; lvl < TW_LEVELS; lvl++)
+    {
+        shift = lvl * TW_BITS;
+        bits = tw_used[lvl] & (~0UL << ((tw_now >> shift) & (TW_SLOTS - 1)));
+        if(!bits)
+            continue;
+
+        start = tw_now >> (shift + TW_BITS) << (shift + TW_BITS);
+        start |= (unsigned long) __builtin_ctzl(bits) << shift;
+        if(start < tw_now)
+            start = tw_now;
+        if(start < best)
+            best = start;
+    }
+    return best;
+}
+
+
+/**
+ * @brief Runs the wheels up to the current time: slots of the upper wheels
+ *  whose turn has come are spread over the wheels below, and threads whose
+ *  deadline has passed are woken
+ */
+static void timer_run(void)
+{
+    unsigned long now = clock_ns() >> TW_SHIFT, tick;
+    unsigned int lvl, slot;
+    thread t, due;
+
+    if(now < tw_due)
+        return;
+
+    LIB_LOCK();
+    while(tw_count && (tick = timer_next()) <= now)
+    {
+        tw_now = tick;
+        for(lvl = TW_LEVELS - 1; lvl > 0; lvl--)
+        {
+            slot = (tick >> (lvl * TW_BITS)) & (TW_SLOTS - 1);
+            if(!(tw_used[lvl] & (1UL << slot)))
+                continue;
+            t = tw_wheel[lvl][slot];
+            tw_wheel[lvl][slot] = NULL;
+            tw_used[lvl] &= ~(1UL << slot);
+            for(; t; t = due)
+            {
+                due = t->timer_next;
+                timer_insert(t);
+            }
+        }
+
+        /* everything in this slot is due now, unless it was parked at the
+           end of a turn of the top wheel */
+        slot = tick & (TW_SLOTS - 1);
+        due = tw_wheel[0][slot];
+        tw_wheel[0][slot] = NULL;
+        tw_used[0] &= ~(1UL << slot);
+        tw_now = tick + 1;
+        for(; due; due = t)
+        {
+            t = due->timer_next;
+            if(due->deadline > tick)
+                timer_insert(due);
+            else
+            {
+                tw_count--;
+                timer_fire(due);
+            }
+        }
+    }
+    tw_due = tw_count ? timer_next() : TW_NONE;
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Sleeps a single worker that has nothing to run until a timer is
+ *  due or, when threads are waiting on I/O, until that comes in too. With
+ *  I/O the next deadline is put on a timerfd in the epoll set. The time
+ *  asleep isn't charged to the thread we are sleeping on.
+ */
+static void idle_wait(void)
+{
+    struct epoll_event ev;
+    struct itimerspec its;
+    struct timespec ts;
+    unsigned long due = tw_count ? tw_due << TW_SHIFT : 0;
+    thread self = ActiveThread;
+
+    if(self->tsc_in)
+        self->stats.cycles += __rdtsc() - self->tsc_in;
+
+    if(!io_waiting)
+    {
+        ts.tv_sec = due / 1000000000UL;
+        ts.tv_nsec = due % 1000000000UL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    else
+    {
+        if(due && tw_fd < 0 &&
+                (tw_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) >= 0)
+        {
+            ev.events = EPOLLIN;
+            ev.data.fd = tw_fd;
+            epoll_ctl(io_epfd, EPOLL_CTL_ADD, tw_fd, &ev);
+        }
+        if(due && tw_fd >= 0)
+        {
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = due / 1000000000UL;
+            its.it_value.tv_nsec = due % 1000000000UL;
+            timerfd_settime(tw_fd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+        io_poll(-1);
+    }
+    self->tsc_in = __rdtsc();
+
+    if(tw_count)
+        timer_run();
+}
+
+
+/******************************************************************************/
+/* Tracing */
+
+/**
+ * @brief Starts recording scheduling events (creates, admissions,
+ *  switches, exits and waits) into a ring of nevents entries, throwing
+ *  away anything recorded before. The ring is allocated by the first call
+ *  and kept, since other workers may still be writing to it, so later
+ *  calls reuse it at that size.
+ * 
+ * @param nevents ring size, rounded up to a power of 2, or 0 for 65536
+ * @return int 0 on success, -1 if the ring can't be allocated
+ */
+int lwp_trace_start(unsigned int nevents)
+{
+    unsigned long size = 1;
+
+    trace_on = FALSE;
+    if(!trace_buf)
+    {
+        if(!nevents)
+            nevents = TRACE_DEFEVENTS;
+        while(size < nevents)
+            size <<= 1;
+        CRIT_ENTER();
+        trace_buf = malloc(size * sizeof(trace_ev));
+        CRIT_EXIT();
+        if(!trace_buf)
+            return -1;
+        trace_mask = size - 1;
+    }
+
+    memset(trace_buf, 0, (trace_mask + 1) * sizeof(trace_ev));
+    __atomic_store_n(&trace_head, 0, __ATOMIC_RELAXED);
+    trace_ns0 = clock_ns();
+    trace_tsc0 = __rdtsc();
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    trace_on = TRUE;
+    return 0;
+}
+
+
+/**
+ * @brief Stops recording. What is in the ring stays there for
+ *  lwp_trace_dump().
+ */
+void lwp_trace_stop(void)
+{
+    trace_on = FALSE;
+}
+
+
+/**
+ * @brief Writes the ring out as Chrome trace event JSON, which
+ *  chrome://tracing and Perfetto both open. Each worker is a track: the
+ *  time between two switches is a slice named for the thread that ran,
+ *  and the other events are instants on the track they happened on. Can
+ *  be called while tracing; events being written at that moment are left
+ *  out.
+ * 
+ * @param path file to write
+ * @return int number of events written, or -1 on error
+ */
+int lwp_trace_dump(const char *path)
+{
+    static const char *names[] = {"create", "admit", "switch", "exit", "wait"};
+    static const char *args[] = {"by", "", "next", "status", "reaped"};
+    unsigned long *since;           /* last switch on each worker */
+    unsigned long head, i, seq, tsc1, ns1;
+    double scale;
+    trace_ev e;
+    FILE *out;
+    unsigned int c;
+    int n = 0;
+
+    if(!trace_buf)
+        return -1;
+    if( !(out = fopen(path, "w")) )
+        return -1;
+    CRIT_ENTER();
+    since = calloc(nworkers, sizeof(unsigned long));
+    CRIT_EXIT();
+    if(!since)
+    {
+        fclose(out);
+        return -1;
+    }
+
+    /* microseconds per TSC tick, measured over the whole trace */
+    tsc1 = __rdtsc();
+    ns1 = clock_ns();
+    scale = tsc1 > trace_tsc0 ?
+        (double) (ns1 - trace_ns0) / (tsc1 - trace_tsc0) / 1000 : 0;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for(c = 0; c < nworkers; c++)
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":\"worker %u\"}}", c ? ",\n" : "",
+            c, c);
+
+    head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    for(i = head > trace_mask ? head - trace_mask - 1 : 0; i < head; i++)
+    {
+        /* copy the slot out and keep it only if nobody reused it meanwhile */
+        seq = __atomic_load_n(&trace_buf[i & trace_mask].seq,
+            __ATOMIC_ACQUIRE);
+        e = trace_buf[i & trace_mask];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(seq != i + 1 ||
+            __atomic_load_n(&trace_buf[i & trace_mask].seq,
+                __ATOMIC_RELAXED) != seq)
+            continue;
+        if(e.cpu >= nworkers || e.tsc < trace_tsc0)
+            continue;
+
+        if(e.type == TR_SWITCH)
+        {
+            /* the slice of whatever ran since the last switch here */
+            if(since[e.cpu])
+            {
+                if(e.tid)
+                    fprintf(out, ",\n{\"name\":\"lwp %lu\"", e.tid);
+                else
+                    fprintf(out, ",\n{\"name\":\"idle\"");
+                fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tid\":%lu,"
+                    "\"next\":%lu}}", e.cpu,
+                    (since[e.cpu] - trace_tsc0) * scale,
+                    (e.tsc - since[e.cpu]) * scale, e.tid, e.arg);
+            }
+            since[e.cpu] = e.tsc;
+        }
+        else
+        {
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"tid\":%lu",
+                names[e.type], e.cpu, (e.tsc - trace_tsc0) * scale, e.tid);
+            if(*args[e.type])
+                fprintf(out, ",\"%s\":%ld", args[e.type], (long) e.arg);
+            fprintf(out, "}}");
+        }
+        n++;
+    }
+    fprintf(out, "\n]}\n");
+
+    CRIT_ENTER();
+    free(since);
+    CRIT_EXIT();
+    if(fclose(out) == EOF)
+        return -1;
+    return n;
+}
+
+
+/**
+ * @brief Records one event. Only called through TRACE(), once tracing is
+ *  on. Lock-free, so it is safe from any worker and from the preemption
+ *  tick.
+ * 
+ * @param type TR_ code
+ * @param tid thread the event is about
+ * @param arg the other thread, or the exit status
+ */
+static void trace_event(unsigned int type, tid_t tid, tid_t arg)
+{
+    unsigned long i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_ev *e = &trace_buf[i & trace_mask];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->tsc = __rdtsc();
+    e->tid = tid;
+    e->arg = arg;
+    e->type = type;
+    e->cpu = Self ? Self - workers : 0;
+    __atomic_store_n(&e->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************/
+/* LWP-local storage */
+
+/**
+ * @brief Makes a key that every thread can hang its own value on, starting
+ *  out NULL in all of them. When a thread exits with a non-NULL value for
+ *  the key, the destructor is called on it.
+ * 
+ * @param key where to put the new key
+ * @param destructor called on a thread's value when it exits, or NULL
+ * @return int 0 on success, -1 if all LWP_KEYS_MAX keys are in use
+ */
+int lwp_key_create(lwp_key *key, void (*destructor)(void *))
+{
+    lwp_key k;
+
+    LIB_LOCK();
+    for(k = 0; k < LWP_KEYS_MAX && key_used[k]; k++)
+        ;
+    if(k < LWP_KEYS_MAX)
+    {
+        key_used[k] = TRUE;
+        key_dtor[k] = destructor;
+    }
+    LIB_UNLOCK();
+
+    if(k == LWP_KEYS_MAX)
+        return -1;
+    *key = k;
+    return 0;
+}
+
+
+/**
+ * @brief Gives a key back. Its destructor is not called; the values live
+ *  threads hold for it are just forgotten, so a key made later starts out
+ *  NULL everywhere like any other.
+ * 
+ * @param key the key
+ * @return int 0 on success, -1 if it isn't a key in use
+ */
+int lwp_key_delete(lwp_key key)
+{
+    thread l;
+
+    LIB_LOCK();
+    if(key >= LWP_KEYS_MAX || !key_used[key])
+    {
+        LIB_UNLOCK();
+        return -1;
+    }
+    for(l = lib_tlist; l; l = l->lnext)
+    {
+        if(key < LWP_KEYS_INLINE)
+            l->specific[key] = NULL;
+        else if(l->specific_more)
+            l->specific_more[key - LWP_KEYS_INLINE] = NULL;
+    }
+    key_used[key] = FALSE;
+    key_dtor[key] = NULL;
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Sets the calling thread's value for a key
+ * 
+ * @param key the key
+ * @param value the value
+ * @return int 0 on success, -1 if the key is bad, the caller isn't an LWP
+ *  or the overflow table can't be allocated
+ */
+int lwp_setspecific(lwp_key key, const void *value)
+{
+    thread self = ActiveThread;
+
+    if(!self || key >= LWP_KEYS_MAX)
+        return -1;
+    if(key < LWP_KEYS_INLINE)
+    {
+        self->specific[key] = (void *) value;
+        return 0;
+    }
+
+    if(!self->specific_more)
+    {
+        if(!value)
+            return 0;
+        CRIT_ENTER();
+        self->specific_more = calloc(LWP_KEYS_MAX - LWP_KEYS_INLINE,
+                                     sizeof(void *));
+        CRIT_EXIT();
+        if(!self->specific_more)
+            return -1;
+    }
+    self->specific_more[key - LWP_KEYS_INLINE] = (void *) value;
+    return 0;
+}
+
+
+/**
+ * @brief Gets the calling thread's value for a key
+ * 
+ * @param key the key
+ * @return void* the value, or NULL if none was set or the key is bad
+ */
+void *lwp_getspecific(lwp_key key)
+{
+    thread self = ActiveThread;
+
+    if(!self || key >= LWP_KEYS_MAX)
+        return NULL;
+    if(key < LWP_KEYS_INLINE)
+        return self->specific[key];
+    if(!self->specific_more)
+        return NULL;
+    return self->specific_more[key - LWP_KEYS_INLINE];
+}
+
+
+/**
+ * @brief Runs the destructors on an exiting thread's values and frees its
+ *  overflow table. A destructor may set values again, so this makes up to
+ *  KEY_ROUNDS passes, after which whatever is left is dropped.
+ * 
+ * @param t the exiting thread, which is the caller
+ */
+static void key_cleanup(thread t)
+{
+    void (*dtor)(void *);
+    void **slot, *value;
+    int round, again, k;
+
+    for(round = 0; round < KEY_ROUNDS; round++)
+    {
+        again = FALSE;
+        for(k = 0; k < LWP_KEYS_MAX; k++)
+        {
+            if(k < LWP_KEYS_INLINE)
+                slot = &t->specific[k];
+            else if(t->specific_more)
+                slot = &t->specific_more[k - LWP_KEYS_INLINE];
+            else
+                break;
+
+            if(*slot && (dtor = key_dtor[k]))
+            {
+                value = *slot;
+                *slot = NULL;
+                dtor(value);
+                again = TRUE;
+            }
+        }
+        if(!again)
+            break;
+    }
+
+    if(t->specific_more)
+    {
+        CRIT_ENTER();
+        free(t->specific_more);
+        CRIT_EXIT();
+        t->specific_more = NULL;
+    }
+}
+
+/******************************************************************************/
+/* Worker pools */
+
+/**
+ * @brief Starts a pool of n worker LWPs that run submitted tasks. The
+ *  workers are ordinary threads, so the pool has to be destroyed before
+ *  lwp_wait() can report that the caller is the last thread left.
+ * 
+ * @param n number of workers
+ * @return lwp_pool* the pool, or NULL if it or a worker couldn't be made
+ */
+lwp_pool *lwp_pool_create(unsigned int n)
+{
+    lwp_pool *p;
+    unsigned int i;
+
+    if(!n)
+        return NULL;
+    CRIT_ENTER();
+    p = malloc(sizeof(struct lwp_pool) + n * sizeof(tid_t));
+    CRIT_EXIT();
+    if(!p)
+        return NULL;
+    memset(p, 0, sizeof(struct lwp_pool));
+
+    for(i = 0; i < n; i++)
+    {
+        if( (p->tids[i] = lwp_create(pool_worker, p, 0)) == NO_THREAD )
+            break;
+        p->n++;
+    }
+    if(p->n < n)
+    {
+        lwp_pool_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+
+
+/**
+ * @brief Queues fn(arg) to run on one of the pool's workers. The task is
+ *  the caller's storage and must stay put until lwp_task_wait() on it has
+ *  returned; nothing is allocated here.
+ * 
+ * @param p the pool
+ * @param task storage for the task, which becomes its future
+ * @param fn function to run
+ * @param arg its argument
+ * @return int 0 on success, -1 if the pool is being destroyed
+ */
+int lwp_pool_submit(lwp_pool *p, lwp_task *task, lwpfun fn, void *arg)
+{
+    task->next = NULL;
+    task->fn = fn;
+    task->arg = arg;
+    task->result = 0;
+    task->done = FALSE;
+    task->waiters.head = task->waiters.tail = NULL;
+
+    LIB_LOCK();
+    if(p->closing)
+    {
+        LIB_UNLOCK();
+        return -1;
+    }
+    if(p->tail)
+        p->tail->next = task;
+    else
+        p->head = task;
+    p->tail = task;
+    if(p->idle.head)
+        thread_wake(waitq_pop(&p->idle));
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Parks the caller until a task has run. Any number of threads may
+ *  wait on the same task.
+ * 
+ * @param task a task handed to lwp_pool_submit()
+ * @return int what its function returned
+ */
+int lwp_task_wait(lwp_task *task)
+{
+    if(task->done)
+        return task->result;
+
+    LIB_LOCK();
+    while(!task->done)
+        thread_park(&task->waiters);
+    LIB_UNLOCK();
+    return task->result;
+}
+
+
+/**
+ * @brief Lets the workers finish every task already queued, then joins
+ *  them and frees the pool. Must not be called from one of its workers.
+ * 
+ * @param p the pool
+ */
+void lwp_pool_destroy(lwp_pool *p)
+{
+    unsigned int i;
+
+    LIB_LOCK();
+    p->closing = TRUE;
+    while(p->idle.head)
+        thread_wake(waitq_pop(&p->idle));
+    LIB_UNLOCK();
+
+    for(i = 0; i < p->n; i++)
+        lwp_join(p->tids[i], NULL);
+
+    CRIT_ENTER();
+    free(p);
+    CRIT_EXIT();
+}
+
+
+/**
+ * @brief Body of a pool worker: takes tasks off the queue in order and
+ *  runs them, parking when there are none, until the pool is destroyed
+ *  and the queue is empty
+ * 
+ * @param arg the pool
+ * @return int 0
+ */
+static int pool_worker(void *arg)
+{
+    lwp_pool *p = arg;
+    lwp_task *task;
+
+    LIB_LOCK();
+    for(;;)
+    {
+        while(!p->head && !p->closing)
+            thread_park(&p->idle);
+        if( !(task = p->head) )
+            break;
+        if( !(p->head = task->next) )
+            p->tail = NULL;
+        LIB_UNLOCK();
+
+        task->result = task->fn(task->arg);
+
+        /* a waiter that sees done may reuse the task at once, so that is
+           the last thing touched. Parked waiters can't look before we
+           unlock */
+        LIB_LOCK();
+        while(task->waiters.head)
+            thread_wake(waitq_pop(&task->waiters));
+        task->done = TRUE;
+    }
+    LIB_UNLOCK();
+    return 0;
+}
+
+/******************************************************************************/
+/* Fork-join */
+
+/**
+ * @brief Spawns fn(arg) as a child of the calling thread (or of the
+ *  spawned task it is running). The child goes on the thread's deque,
+ *  where with several workers a helper thread may steal it; otherwise the
+ *  caller runs it itself at the next lwp_sync(), as a plain function call.
+ *  The task is the caller's storage, and its result is in task->result
+ *  once lwp_sync() returns. A spawned task syncs its own children before
+ *  it counts as finished, and so does a thread that exits.
+ * 
+ * @param task storage for the child
+ * @param fn function to run
+ * @param arg its argument
+ */
+void lwp_spawn(lwp_task *task, lwpfun fn, void *arg)
+{
+    thread self = ActiveThread;
+    lwp_spawner *sp = &self->spawn;
+
+    /* helpers to steal for the other workers start with the first spawn */
+    if(nworkers > 1 && !__atomic_exchange_n(&spawn_started, TRUE,
+                                            __ATOMIC_ACQ_REL))
+        spawn_start();
+
+    task->fn = fn;
+    task->arg = arg;
+    task->result = 0;
+    task->done = FALSE;
+    task->waiters.head = task->waiters.tail = NULL;
+    task->up = sp->frame;
+    task->owner = self;
+    task->stolen = 0;
+    task->next = NULL;
+
+    LIB_LOCK();
+    task->prev = sp->tail;
+    if(sp->tail)
+        sp->tail->next = task;
+    else
+    {
+        sp->head = task;
+        if(nworkers > 1)
+        {
+            /* it has something to steal now */
+            sp->prev = NULL;
+            if( (sp->next = spawn_victims) )
+                spawn_victims->spawn.prev = self;
+            spawn_victims = self;
+        }
+    }
+    sp->tail = task;
+    if(spawn_idle.head)
+        thread_wake(waitq_pop(&spawn_idle));
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Waits for every child spawned since the calling task (or thread)
+ *  last synced. Children still on the deque are run right here, newest
+ *  first; the caller only parks if a helper took one and hasn't finished
+ *  it yet.
+ */
+void lwp_sync(void)
+{
+    thread self = ActiveThread;
+    lwp_spawner *sp = &self->spawn;
+    lwp_task *frame = sp->frame;
+    unsigned long *stolen = frame ? &frame->stolen : &sp->stolen;
+    lwp_task *task;
+
+    /* children of this frame are the newest on the deque, since any task
+       spawned after them has synced its own before returning */
+    for(;;)
+    {
+        LIB_LOCK();
+        if( (task = sp->tail) && task->up == frame )
+            spawn_unlink(self, task);
+        else
+            task = NULL;
+        LIB_UNLOCK();
+        if(!task)
+            break;
+
+        spawn_run(sp, task);
+        task->done = TRUE;
+    }
+
+    /* while helpers finish the rest, help with whatever else there is */
+    LIB_LOCK();
+    while(*stolen)
+    {
+        if(spawn_victims)
+            spawn_steal();
+        else
+        {
+            sp->waiting = stolen;
+            thread_park(NULL);
+        }
+    }
+    LIB_UNLOCK();
+}
+
+
+/**
+ * @brief Starts a helper for each worker after the first. Helpers are
+ *  left out of lwp_wait()'s count of threads, and are told to exit once
+ *  they are all that is left.
+ */
+static void spawn_start(void)
+{
+    unsigned int i;
+
+    for(i = 1; i < nworkers; i++)
+    {
+        LIB_LOCK();
+        spawn_helpers++;
+        LIB_UNLOCK();
+        if(lwp_create(spawn_helper, NULL, 0) == NO_THREAD)
+        {
+            LIB_LOCK();
+            spawn_helpers--;
+            LIB_UNLOCK();
+        }
+    }
+}
+
+
+/**
+ * @brief Runs a spawned task on the calling thread, as a frame of its own
+ *  so the task's children are synced before it returns
+ * 
+ * @param sp the calling thread's spawner
+ * @param task the task
+ */
+static void spawn_run(lwp_spawner *sp, lwp_task *task)
+{
+    lwp_task *up = sp->frame;
+
+    sp->frame = task;
+    task->result = task->fn(task->arg);
+    lwp_sync();
+    sp->frame = up;
+}
+
+
+/**
+ * @brief Takes a task off its owner's deque, and the owner off the victim
+ *  list if that empties it. Library locked.
+ * 
+ * @param owner the thread whose deque it is
+ * @param task the task
+ */
+static void spawn_unlink(thread owner, lwp_task *task)
+{
+    lwp_spawner *sp = &owner->spawn;
+
+    if(task->prev)
+        task->prev->next = task->next;
+    else
+        sp->head = task->next;
+    if(task->next)
+        task->next->prev = task->prev;
+    else
+        sp->tail = task->prev;
+
+    if(!sp->head && nworkers > 1)
+    {
+        if(sp->prev)
+            sp->prev->spawn.next = sp->next;
+        else
+            spawn_victims = sp->next;
+        if(sp->next)
+            sp->next->spawn.prev = sp->prev;
+    }
+}
+
+
+/**
+ * @brief Steals the oldest task of the first thread on spawn_victims and
+ *  runs it, then wakes the owner if it is parked in lwp_sync() waiting
+ *  for just that. Called with the library locked, and returns with it
+ *  locked again.
+ */
+static void spawn_steal(void)
+{
+    lwp_task *task;
+    unsigned long *stolen;
+    thread owner;
+
+    /* the oldest is usually the biggest piece of work */
+    task = spawn_victims->spawn.head;
+    owner = task->owner;
+    spawn_unlink(owner, task);
+    stolen = task->up ? &task->up->stolen : &owner->spawn.stolen;
+    (*stolen)++;
+    LIB_UNLOCK();
+
+    spawn_run(&ActiveThread->spawn, task);
+
+    LIB_LOCK();
+    task->done = TRUE;
+    if(--*stolen == 0 && owner->spawn.waiting == stolen)
+    {
+        owner->spawn.waiting = NULL;
+        thread_wake(owner);
+    }
+}
+
+
+/**
+ * @brief Body of a helper: steals tasks from threads with spawned
+ *  children, parking when there is nothing to steal
+ * 
+ * @param arg unused
+ * @return int 0
+ */
+static int spawn_helper(void *arg)
+{
+    LIB_LOCK();
+    for(;;)
+    {
+        while(!spawn_victims && !spawn_quit)
+            thread_park(&spawn_idle);
+        if(spawn_quit)
+            break;
+        spawn_steal();
+    }
+    spawn_helpers--;
+    LIB_UNLOCK();
+    return 0;
+}
+
+/******************************************************************************/
+/* Stackless threads */
+
+/**
+ * @brief Creates a thread with no stack of its own. Every time the
+ *  scheduler picks it, step(arg) is called on the worker's carrier stack,
+ *  and the thread stays runnable for as long as step returns
+ *  LWP_STEP_AGAIN; any other value is its exit status. Otherwise it is an
+ *  ordinary thread, with a tid, a place in the active scheduler beside
+ *  stack threads, stats, and lwp_join() or lwp_wait() to reap it.
+ *
+ *  A step can't block, yield, exit or spawn, since there is nowhere to
+ *  keep it while it is switched out; it returns instead, and may park
+ *  with lwp_step_park() or lwp_step_join() first. A key destructor run at
+ *  its exit is part of its last step.
+ * 
+ * @param step called each time the thread runs
+ * @param arg its argument
+ * @return tid_t id of the created thread or NO_THREAD if there was an error
+ */
+tid_t lwp_create_stackless(lwpstep step, void *arg)
+{
+    thread new_thread;
+    tid_t tid;
+
+    if(carrier_init() < 0 || !(new_thread = ctx_alloc()) )
+        return NO_THREAD;
+
+    /* where thread_new keeps the starting function and its argument */
+    new_thread->flags = LWP_STACKLESS;
+    new_thread->state.rdi = (unsigned long) step;
+    new_thread->state.rsi = (unsigned long) arg;
+    if( (tid = thread_register(new_thread)) == NO_THREAD )
+        return NO_THREAD;
+
+    TRACE(TR_CREATE, tid, lwp_gettid());
+    make_runnable(new_thread);
+
+    return tid;
+}
+
+
+/**
+ * @brief Asks for the calling stackless thread to be parked once its
+ *  step returns, until someone lwp_unpark()s it. If that already happened
+ *  since it last parked, it stays runnable instead.
+ * 
+ * @return int 0, or -1 if the caller isn't in a step
+ */
+int lwp_step_park(void)
+{
+    thread self = ActiveThread;
+
+    if(!Stepping)
+        return -1;
+
+    LIB_LOCK();
+    self->flags |= LWP_PARKING;
+    LIB_UNLOCK();
+    return 0;
+}
+
+
+/**
+ * @brief Makes a stackless thread that parked with lwp_step_park()
+ *  runnable again. If it hasn't parked yet, its next park is skipped; at
+ *  most one wakeup is remembered.
+ * 
+ * @param tid the thread
+ * @return int 0, or -1 if it isn't a live stackless thread
+ */
+int lwp_unpark(tid_t tid)
+{
+    thread t;
+    int ok;
+
+    LIB_LOCK();
+    t = tid_lookup(tid);
+    ok = t && (t->flags & LWP_STACKLESS) && !LWPTERMINATED(t->status);
+    if(ok)
+        step_wake(t);
+    LIB_UNLOCK();
+
+    return ok ? 0 : -1;
+}
+
+
+/**
+ * @brief lwp_join_with() for a step, which can't wait. If the thread has
+ *  exited it is reaped as lwp_join_with() would; otherwise the caller is
+ *  made its joiner and parked once the step returns, and is woken when the
+ *  thread exits to call this again.
+ * 
+ * @param tid thread to reap
+ * @param status where to put its termination status, or NULL
+ * @param fn called as for lwp_join_with(), or NULL
+ * @param ctx passed to fn
+ * @return int 0 once it is reaped, 1 if the step has to wait for it, or
+ *  -1 if the caller isn't in a step, there is no such thread, it is the
+ *  caller, or someone else is joining it
+ */
+int lwp_step_join(tid_t tid, int *status, void (*fn)(void *), void *ctx)
+{
+    thread self = ActiveThread;
+    thread t;
+
+    if(!Stepping)
+        return -1;
+
+    LIB_LOCK();
+    if( !(t = tid_lookup(tid)) || t == self ||
+            (t->joiner && t->joiner != self) )
+    {
+        LIB_UNLOCK();
+        return -1;
+    }
+
+    if(!LWPTERMINATED(t->status))
+    {
+        t->joiner = self;
+        self->flags |= LWP_PARKING;
+        LIB_UNLOCK();
+        return 1;
+    }
+
+    /* it only went on the zombie list if it exited before we asked */
+    if(t->joiner != self)
+    {
+        list_unlink(&zombies, t);
+        lib_zombies--;
+    }
+    LIB_UNLOCK();
+
+    thread_reap(t, status, fn, ctx);
+    return 0;
+}
 
+
+/**
+ * @brief Wakes a parked thread for lwp_unpark() or a thread it joined
+ *  exiting. A stackless thread that has asked to park but whose step
+ *  hasn't returned yet keeps running instead. Library locked.
+ * 
+ * @param t the thread
+ */
+static void step_wake(thread t)
+{
+    if(t->flags & LWP_PARKED)
+        thread_wake(t);
+    else if(t->flags & LWP_STACKLESS)
+        t->flags |= LWP_UNPARKED;
 }
 
 
 /**
- * @brief Returns the pointer to the current scheduler.
+ * @brief Gives every worker a carrier the first time a stackless thread
+ *  is made. Carriers aren't threads of their own: they have no tid, are
+ *  never in the scheduler, and are only switched to in the name of the
+ *  stackless thread they are to run.
  * 
- * @return scheduler 
+ * @return int 0 on success, -1 if a carrier couldn't be made
  */
-scheduler lwp_get_scheduler(void)
+static int carrier_init(void)
 {
-    return ActiveScheduler;
+    thread *slot;
+    unsigned int i;
+    int ok = TRUE;
+
+    if(__atomic_load_n(&carriers_made, __ATOMIC_ACQUIRE))
+        return 0;
+
+    spin_lock(&carrier_lock);
+    for(i = 0; ok && i < nworkers; i++)
+    {
+        slot = nworkers > 1 ? &workers[i].carrier : &carrier;
+        if(!*slot && !(*slot = thread_new(carrier_main, NULL, 0, 0)) )
+            ok = FALSE;
+    }
+    if(ok)
+        __atomic_store_n(&carriers_made, TRUE, __ATOMIC_RELEASE);
+    spin_unlock(&carrier_lock);
+
+    return ok ? 0 : -1;
 }
 
 
 /**
- * @brief Returns the thread corresponding to the given thread ID, or NULL
- *  if the ID is invalid
+ * @brief A carrier's loop. It is switched to with ActiveThread already set
+ *  to the stackless thread to run, runs one step of it, then does what
+ *  lwp_yield(), a park or lwp_exit() would have done for it. If the next
+ *  thread is stackless too the switch comes straight back here.
  * 
- * @param tid id of the thread we want
- * @return thread
+ * @param arg unused
+ * @return int never returns
  */
-thread tid2thread(tid_t tid)
+static int carrier_main(void *arg)
 {
-    context dummy;
-    thread l;
+    thread self;
+    int rval;
 
-    /* setup a dummy to point to the start of our threads */
-    dummy.lib_one = lib_tlist;
+    for(;;)
+    {
+        self = ActiveThread;
 
-    /* go until the end or we find our target */
-    for (l = &dummy; l->lib_one && l->lib_one->tid != tid; l = l->lib_one);
+        /* a tick during the step waits for the switch below */
+        CRIT_ENTER();
+        Stepping = TRUE;
+        rval = ((lwpstep) self->state.rdi)((void *) self->state.rsi);
+        if(rval != LWP_STEP_AGAIN)
+            key_cleanup(self);
+        Stepping = FALSE;
 
-    /* return the thread if we found it */
-    if(l->lib_one)
-        return l->lib_one;
-    else
-        return NULL;
+        if(rval != LWP_STEP_AGAIN)
+            thread_retire(self, rval);
+        else if(self->flags & LWP_PARKING)
+        {
+            LIB_LOCK();
+            if(self->flags & LWP_UNPARKED)
+                self->flags &= ~LWP_UNPARKED;
+            else
+            {
+                ActiveScheduler->remove(self);
+                self->flags |= LWP_PARKED;
+                lib_parked++;
+            }
+            self->flags &= ~LWP_PARKING;
+            LIB_UNLOCK();
+        }
+
+        lwp_resched();
+        CRIT_EXIT();
+    }
+    return 0;
 }
 
 /******************************************************************************/
 /* Default Scheduler Definition */
 
-static thread qhead = NULL;
+/* each worker runs its own ring */
+static LWP_TLS thread qhead = NULL;
 #define tnext sched_one
 #define tprev sched_two
 
@@ -436,38 +4248,25 @@ static void r_admit(thread new)
 
 static void r_remove(thread victim)
 {
-    context dummy;
-    thread l;
+    /* threads that aren't queued have NULL links, so there's no search */
+    if(!victim->tnext)
+        return;
 
-    if(qhead)
+    if(victim->tnext == victim)
+        qhead = NULL;
+    else
     {
-        if(qhead == victim)
-        {
-            /* cut out of queue */
-            victim->tprev->tnext = victim->tnext;
-            victim->tnext->tprev = victim->tprev;
-            
-            /* what if it were qhead? */
-            if (victim->tnext != victim)
-                qhead = victim->tnext;
-            else
-                qhead = NULL;
-        }
-        else
-        {
-            dummy.tnext = qhead->tnext;
+        /* cut out of queue */
+        victim->tprev->tnext = victim->tnext;
+        victim->tnext->tprev = victim->tprev;
 
-            for (l = &dummy; (l->tnext) && (l->tnext != victim) && (l->tnext != qhead); l = l->tnext);
-
-            /* if we found it in tlist and it didn't loop */
-            if (l->tnext && l->tnext != qhead)
-            {
-                /* cut out of queue */
-                victim->tprev->tnext = victim->tnext;
-                victim->tnext->tprev = victim->tprev;
-            }
-        }
+        /* what if it were qhead? */
+        if(qhead == victim)
+            qhead = victim->tnext;
     }
+
+    victim->tnext = NULL;
+    victim->tprev = NULL;
 }
 
 static thread r_next(void)
@@ -485,29 +4284,525 @@ static thread r_next(void)
     return res;
 }
 
+/**
+ * @brief Tells the scheduler that t is about to run although next() didn't
+ *  pick it. Schedulers without a handoff hook get t taken out and admitted
+ *  again, which puts it at the back of its queue, the same place next()
+ *  would have left it. Single worker only, with the lock held.
+ *
+ * @param t the thread that runs next
+ */
+static void sched_handoff(thread t)
+{
+    if(ActiveHandoff)
+        ActiveHandoff(t);
+    else
+    {
+        ActiveScheduler->remove(t);
+        ActiveScheduler->admit(t);
+    }
+}
+
 
 /******************************************************************************/
 /* Helper functions */
 
-void *malloc_16(size_t size)
+/**
+ * @brief Allocates a zeroed context with its FPU state initialized and no
+ *  XSAVE area. Contexts come off the free list, or else are cut from the
+ *  newest slab, so this makes no malloc() call and only maps memory once
+ *  per slab.
+ * 
+ * @return thread the new context or NULL if no slab could be mapped
+ */
+static thread ctx_alloc(void)
+{
+    thread t;
+
+    if(!fpu_probed)
+        fpu_probe();
+
+    LIB_LOCK();
+    if( (t = ctx_list) )
+        ctx_list = *(thread *) t;
+    else
+        t = slab_cut(CTX_ROUND(sizeof(context)));
+    LIB_UNLOCK();
+    if(!t)
+        return NULL;
+    memset(t, 0, sizeof(context));
+
+    t->priority = LWP_PRIO_DEFAULT;
+    t->weight = LWP_WEIGHT_DEFAULT;
+
+    /* setup the FP register */
+    t->state.fxsave = FPU_INIT;
+    return t;
+}
+
+/**
+ * @brief Takes an XSAVE area off the free list, or cuts one from the
+ *  newest slab. Called with the library locked.
+ * 
+ * @return void* the area, not initialized, or NULL if no slab could be
+ *  mapped
+ */
+static void *xsave_alloc(void)
+{
+    void *area;
+
+    if( (area = xsave_list) )
+        xsave_list = *(void **) area;
+    else
+        area = slab_cut(CTX_ROUND(xsave_size));
+    return area;
+}
+
+/**
+ * @brief Cuts a slot off the newest slab, mapping a new one when it is
+ *  used up. Slots are multiples of CTX_ALIGN, so every one starts on that
+ *  boundary. Called with the library locked.
+ * 
+ * @param size bytes, a multiple of CTX_ALIGN
+ * @return void* the slot or NULL if no slab could be mapped
+ */
+static void *slab_cut(size_t size)
+{
+    char *slab;
+
+    if(slab_next + size > slab_end)
+    {
+        slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(slab == MAP_FAILED)
+        {
+            perror("mmap");
+            return NULL;
+        }
+        slab_next = slab;
+        slab_end = slab + SLAB_SIZE;
+    }
+    slab = slab_next;
+    slab_next += size;
+    return slab;
+}
+
+/**
+ * @brief Puts a context, and its XSAVE area if it has one, back on the
+ *  free lists. Called with the library locked.
+ * 
+ * @param t the context
+ */
+static void ctx_free(thread t)
+{
+    if(t->state.xsave)
+    {
+        *(void **) t->state.xsave = xsave_list;
+        xsave_list = t->state.xsave;
+    }
+    *(thread *) t = ctx_list;
+    ctx_list = t;
+}
+
+/**
+ * @brief Asks CPUID whether the OS has XSAVE turned on, how big the save
+ *  area is for the enabled features, and which XSAVE flavour to use
+ */
+static void fpu_probe(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    fpu_probed = TRUE;
+
+    /* XSAVE has to be there and enabled in CR4 (OSXSAVE) */
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+        return;
+    if(__get_cpuid_max(0, NULL) < 0xd)
+        return;
+
+    /* ebx of leaf 0xd/0 is the area size for what XCR0 has enabled */
+    __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+    xsave_size = ebx;
+
+    /* XSAVEOPT's modified optimization only pays off when a thread is
+       saved right after its own restore, which a switch never does, so
+       XSAVEC's compaction wins when we have both */
+    __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+    if(eax & 0x2)
+        lwp_xsave_mode = XSAVE_C;
+    else if(eax & 0x1)
+        lwp_xsave_mode = XSAVE_OPT;
+    else
+        lwp_xsave_mode = XSAVE_PLAIN;
+}
+
+/**
+ * @brief Works out the page size and the default stack size (RLIMIT_STACK
+ *  rounded up to a page) once, so creating a thread doesn't have to
+ * 
+ * @return int 0 on success, -1 if the stack limit can't be read
+ */
+static int stack_init(void)
+{
+    struct rlimit rlim;
+
+    pagesize = sysconf(_SC_PAGE_SIZE);
+
+    /* get the max stack size */
+    if(getrlimit(RLIMIT_STACK, &rlim) < 0)
+    {
+        /* failed to get stack size */
+        return -1;
+    }
+    if(rlim.rlim_cur == RLIM_INFINITY)
+    {
+        /* No limit, so we set it to 8MB */
+        default_stacksize = (2 << 23);
+    }
+    else
+    {
+        /* There is a limit, round it up to the nearest page */
+        if (rlim.rlim_cur % pagesize > 0)
+            default_stacksize = rlim.rlim_cur + (pagesize - (rlim.rlim_cur % pagesize));
+        else
+            default_stacksize = rlim.rlim_cur;
+    }
+    return 0;
+}
+
+/**
+ * @brief Hands out a stack of the given size, reusing a pooled one if there
+ *  is one and mapping a new one otherwise. New stacks are reserved with
+ *  MAP_NORESERVE so only the pages a thread touches are ever committed, and
+ *  the lowest page is made inaccessible if it is to be a guard. A pooled
+ *  stack is only reused for a request with the same guard setting.
+ * 
+ * @param size size of the stack in bytes (a multiple of the page size)
+ * @param guard nonzero to make the lowest page a guard page
+ * @return unsigned long* base of the stack or NULL on failure
+ */
+static unsigned long *stack_alloc(size_t size, int guard)
 {
-    unsigned char *thread_ptr;
-    unsigned char *malloc_ptr = malloc(sizeof(context) + 16);
+    unsigned long *stack;
+    int i;
+
+    guard = !!guard;
+    for(i = 0; i < POOL_SIZES && pool[i].size; i++)
+    {
+        if(pool[i].size == size && pool[i].guarded == guard && pool[i].head)
+        {
+            stack = pool[i].head;
+            pool[i].head = (unsigned long *) stack[size / sizeof(unsigned long) - 1];
+            pool[i].count--;
+            pool_stats.pooled--;
+            pool_stats.hits++;
+            return stack;
+        }
+    }
 
-    if(!malloc_ptr)
+    pool_stats.misses++;
+    stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if(stack == MAP_FAILED)
     {
-        perror("malloc");
+        perror("mmap");
+        return NULL;
+    }
+    if(guard && mprotect(stack, pagesize, PROT_NONE) < 0)
+    {
+        perror("mprotect");
+        munmap(stack, size);
         return NULL;
     }
+    return stack;
+}
+
+/**
+ * @brief Returns a stack to the pool for its size and guard setting, or
+ *  unmaps it if the pool is full. All but the top page of a cold pooled
+ *  stack is given back to the kernel; the top page holds the pool link.
+ * 
+ * @param stack base of the stack
+ * @param size size of the stack in bytes
+ * @param guard nonzero if its lowest page is a guard page
+ */
+static void stack_free(unsigned long *stack, size_t size, int guard)
+{
+    int i;
+
+    /* find the bucket for this size and guard, claiming an empty one if
+       need be */
+    guard = !!guard;
+    for(i = 0; i < POOL_SIZES && pool[i].size &&
+            (pool[i].size != size || pool[i].guarded != guard); i++);
+    if(i == POOL_SIZES || pool[i].count >= pool_cap)
+    {
+        munmap(stack, size);
+        return;
+    }
+    pool[i].size = size;
+    pool[i].guarded = guard;
+
+    if(pool[i].count >= POOL_HOT && size > pagesize)
+    {
+        madvise(stack, size - pagesize, MADV_DONTNEED);
+        pool_stats.trims++;
+    }
+
+    stack[size / sizeof(unsigned long) - 1] = (unsigned long) pool[i].head;
+    pool[i].head = stack;
+    pool[i].count++;
+    pool_stats.pooled++;
+}
+
+/**
+ * @brief Pushes a thread onto the front of a library list
+ * 
+ * @param head head of the list
+ * @param t thread to add
+ */
+static void list_push(thread *head, thread t)
+{
+    t->lprev = NULL;
+    t->lnext = *head;
+    if(*head)
+        (*head)->lprev = t;
+    *head = t;
+}
+
+/**
+ * @brief Cuts a thread out of a library list
+ * 
+ * @param head head of the list the thread is on
+ * @param t thread to remove
+ */
+static void list_unlink(thread *head, thread t)
+{
+    if(t->lprev)
+        t->lprev->lnext = t->lnext;
+    else
+        *head = t->lnext;
+    if(t->lnext)
+        t->lnext->lprev = t->lprev;
+    t->lnext = NULL;
+    t->lprev = NULL;
+}
+
+/**
+ * @brief Gives the thread a slot in the tid table and returns its new tid.
+ *  Released slots are reused first, with their generation bumped.
+ * 
+ * @param t thread that will own the tid
+ * @return tid_t the new tid or NO_THREAD if the table couldn't grow
+ */
+static tid_t tid_alloc(thread t)
+{
+    unsigned long i;
+    tidslot *table;
+    unsigned long *freelist;
+
+    if(tid_nfree)
+        i = tid_free[--tid_nfree];
+    else
+    {
+        /* grow the table (and the free stack with it) when it's full */
+        if(tid_top >= tid_cap)
+        {
+            unsigned long cap = tid_cap ? tid_cap * 2 : TID_INITSLOTS;
+
+            if(cap > TID_SLOTMASK)
+                return NO_THREAD;
+            if( !(table = realloc(tid_table, cap * sizeof(tidslot))) )
+                return NO_THREAD;
+            tid_table = table;
+            if( !(freelist = realloc(tid_free, cap * sizeof(unsigned long))) )
+                return NO_THREAD;
+            tid_free = freelist;
+            tid_cap = cap;
+        }
+
+        /* first use of the slot is generation zero, so tids start at 1 */
+        i = tid_top++;
+        tid_table[i].tid = i;
+    }
+
+    tid_table[i].owner = t;
+    return tid_table[i].tid;
+}
+
+/**
+ * @brief Frees the tid's slot and advances its generation so the old tid
+ *  no longer resolves.
+ * 
+ * @param tid tid being retired
+ */
+static void tid_release(tid_t tid)
+{
+    unsigned long i = tid & TID_SLOTMASK;
+
+    if(i == NO_THREAD || i >= tid_top || tid_table[i].tid != tid)
+        return;
+
+    tid_table[i].owner = NULL;
+    tid_table[i].tid = tid + (1UL << TID_SLOTBITS);
+
+    /* a slot whose generation wrapped around is retired for good */
+    if(tid_table[i].tid & ~TID_SLOTMASK)
+        tid_free[tid_nfree++] = i;
+}
+
+/**
+ * @brief Looks up a tid in the table. The caller holds the library lock.
+ * 
+ * @param tid id of the thread we want
+ * @return thread the thread or NULL if the tid is stale or invalid
+ */
+static thread tid_lookup(tid_t tid)
+{
+    unsigned long i = tid & TID_SLOTMASK;
+
+    /* a stale tid carries an old generation and won't match */
+    if(i < tid_top && tid_table[i].tid == tid)
+        return tid_table[i].owner;
+    return NULL;
+}
+
+/**
+ * @brief Adds a thread to the back of a wait queue
+ * 
+ * @param q the queue
+ * @param t thread to add
+ */
+static void waitq_push(lwp_waitq *q, thread t)
+{
+    t->waitq = q;
+    t->wait_next = NULL;
+    if(q->tail)
+        q->tail->wait_next = t;
+    else
+        q->head = t;
+    q->tail = t;
+}
+
+/**
+ * @brief Takes the thread off the front of a wait queue
+ * 
+ * @param q the queue
+ * @return thread the thread or NULL if the queue is empty
+ */
+static thread waitq_pop(lwp_waitq *q)
+{
+    thread t;
+
+    if( (t = q->head) )
+    {
+        if( !(q->head = t->wait_next) )
+            q->tail = NULL;
+        t->wait_next = NULL;
+        t->waitq = NULL;
+    }
+    return t;
+}
+
+/**
+ * @brief Takes a thread out of the middle of a wait queue
+ * 
+ * @param q the queue
+ * @param t the thread, which must be on it
+ */
+static void waitq_remove(lwp_waitq *q, thread t)
+{
+    thread *link, prev = NULL;
+
+    for(link = &q->head; *link != t; link = &(*link)->wait_next)
+        prev = *link;
+    *link = t->wait_next;
+    if(q->tail == t)
+        q->tail = prev;
+    t->wait_next = NULL;
+    t->waitq = NULL;
+}
+
+/**
+ * @brief Reads CLOCK_MONOTONIC
+ * 
+ * @return unsigned long the time in nanoseconds
+ */
+static unsigned long clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * @brief Adds a channel waiter to the back of a channel queue
+ * 
+ * @param q the queue
+ * @param w the waiter
+ */
+static void chanq_push(chanq *q, chanwait *w)
+{
+    w->next = NULL;
+    w->prev = q->tail;
+    if(q->tail)
+        q->tail->next = w;
+    else
+        q->head = w;
+    q->tail = w;
+    w->queued = TRUE;
+}
+
+/**
+ * @brief Cuts a channel waiter out of a channel queue
+ * 
+ * @param q the queue
+ * @param w the waiter
+ */
+static void chanq_unlink(chanq *q, chanwait *w)
+{
+    if(w->prev)
+        w->prev->next = w->next;
+    else
+        q->head = w->next;
+    if(w->next)
+        w->next->prev = w->prev;
+    else
+        q->tail = w->prev;
+    w->queued = FALSE;
+}
+
+/**
+ * @brief Takes the first waiter off a channel queue whose select hasn't
+ *  already gone on another case. Those are dropped along the way.
+ * 
+ * @param q the queue
+ * @return chanwait* the waiter or NULL if there is none
+ */
+static chanwait *chanq_take(chanq *q)
+{
+    chanwait *w;
 
-    thread_ptr = (unsigned char *) (((unsigned long) (malloc_ptr + 16)) & (~0xf));
-    *(thread_ptr-1) = thread_ptr - malloc_ptr;
-    return thread_ptr;
+    while( (w = q->head) )
+    {
+        chanq_unlink(q, w);
+        if(!w->sel->fired)
+            return w;
+    }
+    return NULL;
 }
 
-void free_16(void *ptr)
+/**
+ * @brief Completes a parked channel operation and wakes its thread
+ * 
+ * @param w the waiter whose operation is done
+ * @param ok 0 if it went through, -1 if the channel closed
+ */
+static void chan_fire(chanwait *w, int ok)
 {
-    unsigned char *malloc_ptr = ptr;
-    malloc_ptr = malloc_ptr - *(malloc_ptr-1);
-    free(malloc_ptr);
+    w->ok = ok;
+    w->sel->fired = w;
+    thread_wake(w->sel->t);
 }
+
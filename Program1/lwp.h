@@ -2,6 +2,10 @@
 #define LWPH
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifndef TRUE
 #define TRUE 1
 #endif
@@ -31,6 +35,7 @@ registers {
   unsigned long r14;
   unsigned long r15;
   struct fxsave fxsave;   /* space to save floating point state */
+  void          *xsave;   /* XSAVE area if the CPU has one, or NULL */
 } rfile;
 #elif defined(__i386)
 typedef struct registers {
@@ -50,41 +55,258 @@ typedef struct registers {
 typedef unsigned long tid_t;
 #define NO_THREAD 0             /* an always invalid thread id */
 
+/* LWP-local storage, see lwp_key_create() */
+typedef unsigned int lwp_key;
+#define LWP_KEYS_INLINE 8       /* keys whose values live in the context */
+#define LWP_KEYS_MAX    256     /* keys in all                           */
+
+/* per thread counters, see lwp_stats() */
+typedef struct lwp_threadstats {
+  unsigned long switches_in;
+  unsigned long switches_out;
+  unsigned long voluntary;      /* switched out by a yield or a block */
+  unsigned long involuntary;    /* switched out by a preemption tick  */
+  unsigned long cycles;         /* TSC cycles spent running           */
+} lwp_threadstats;
+
 typedef struct threadinfo_st *thread;
+
+/* a thread's spawned children, see lwp_spawn() */
+typedef struct lwp_spawner {
+  struct lwp_task *head;        /* oldest, where others steal from   */
+  struct lwp_task *tail;        /* newest, where the owner pops      */
+  struct lwp_task *frame;       /* spawned task running here, if any */
+  unsigned long stolen;         /* top level children others took    */
+  unsigned long *waiting;       /* count lwp_sync() is parked on     */
+  thread        next;           /* on the list of threads to steal   */
+  thread        prev;           /* from while there is a head        */
+} lwp_spawner;
+
 typedef struct threadinfo_st {
   tid_t         tid;            /* lightweight process id  */
   unsigned long *stack;         /* Base of allocated stack */
   size_t        stacksize;      /* Size of allocated stack */
   rfile         state;          /* saved registers         */
   unsigned int  status;         /* exited? exit status?    */
+  unsigned int  flags;          /* LWP_FPU and friends     */
+  unsigned int  oncpu;          /* registers not saved yet */
+  unsigned int  priority;       /* 0 is the most urgent    */
+  unsigned int  weight;         /* share of the CPU        */
+  unsigned long vruntime;       /* weighted cycles run     */
   thread        lib_one;        /* Two pointers reserved   */
   thread        lib_two;        /* for use by the library  */
-  thread        sched_one;      /* Two more for            */
+  thread        sched_one;      /* Three more for          */
   thread        sched_two;      /* schedulers to use       */
+  thread        sched_three;    /* (heaps need three)      */
+  thread        wait_next;      /* wait queue while parked */
+  struct lwp_waitq *waitq;      /* the queue we are on     */
+  thread        joiner;         /* thread in lwp_join on us */
+  unsigned long deadline;       /* timer tick, if LWP_TIMED */
+  unsigned int  timer_slot;     /* wheel and slot it is in */
+  thread        timer_next;     /* timer wheel slot links  */
+  thread        timer_prev;
+  unsigned long tsc_in;         /* TSC when last switched in */
+  lwp_threadstats stats;        /* see lwp_stats()         */
+  void          *specific[LWP_KEYS_INLINE]; /* key values  */
+  void          **specific_more; /* the rest, allocated on first use */
+  lwp_spawner   spawn;          /* see lwp_spawn()         */
 } context;
 
+#define LWP_FPU 0x1             /* switch the full FPU state */
+#define LWP_PARKED 0x2          /* blocked, out of the scheduler */
+#define LWP_TIMED 0x4           /* parked with a timer armed */
+#define LWP_TIMEDOUT 0x8        /* woken by its timer */
+#define LWP_STACKLESS 0x10      /* no stack, see lwp_create_stackless */
+#define LWP_PARKING 0x20        /* park once this step returns */
+#define LWP_UNPARKED 0x40       /* lwp_unpark() came before the park */
+#define LWP_GUARDED 0x80        /* lowest page of its stack is a guard */
+
+#define LWP_PRIO_LEVELS   64    /* priorities run 0..LWP_PRIO_LEVELS-1 */
+#define LWP_PRIO_DEFAULT  32    /* priority of a new thread            */
+#define LWP_WEIGHT_DEFAULT 1024 /* weight of a new thread              */
+
 typedef int (*lwpfun)(void *);  /* type for lwp function */
+typedef void (*lwpinit)(void *where, void *ctx); /* see lwp_create_inplace */
+typedef int (*lwpstep)(void *arg);  /* see lwp_create_stackless */
+#define LWP_STEP_AGAIN  (-1)        /* a step that isn't finished   */
+
+/* FIFO of parked threads, linked through wait_next */
+typedef struct lwp_waitq {
+  thread head;
+  thread tail;
+} lwp_waitq;
+
+/* blocking synchronization. Waiters park, off the scheduler */
+typedef struct lwp_mutex {
+  volatile unsigned int state;  /* 0 free, 1 held, 2 held and contended */
+  lwp_waitq     waiters;
+} lwp_mutex;
+
+typedef struct lwp_cond {
+  lwp_waitq     waiters;
+} lwp_cond;
+
+typedef struct lwp_sem {
+  volatile long count;          /* below zero: threads waiting */
+  long          wakeups;        /* units posted to waiters not parked yet */
+  lwp_waitq     waiters;
+} lwp_sem;
+
+/* channels carry pointers; the pointer is the message */
+typedef struct lwp_chan lwp_chan;
+
+typedef struct lwp_chan_op {    /* one case of lwp_chan_select() */
+  lwp_chan      *chan;
+  int           send;           /* TRUE to send msg, FALSE to receive  */
+  void          *msg;           /* message sent, or the one received   */
+  int           result;         /* 0, or -1 if the channel was closed  */
+} lwp_chan_op;
 
-/* Tuple that describes a scheduler */
-typedef struct scheduler {
+/* worker pools run tasks on long-lived LWPs, and lwp_spawn() runs them
+   fork-join style. The caller owns each task's storage, which doubles as
+   the queue link and the future */
+typedef struct lwp_pool lwp_pool;
+
+typedef struct lwp_task {
+  struct lwp_task *next;        /* pool queue or spawn deque link */
+  struct lwp_task *prev;
+  lwpfun        fn;
+  void          *arg;
+  int           result;         /* fn's return value, once done */
+  volatile int  done;
+  lwp_waitq     waiters;        /* in lwp_task_wait()         */
+  struct lwp_task *up;          /* spawned from within this task */
+  thread        owner;          /* thread that spawned it     */
+  unsigned long stolen;         /* its children others took   */
+} lwp_task;
+
+#define LWP_MUTEX_INITIALIZER     { 0, { 0, 0 } }
+#define LWP_COND_INITIALIZER      { { 0, 0 } }
+#define LWP_SEM_INITIALIZER(v)    { (v), 0, { 0, 0 } }
+
+/* Tuple that describes a scheduler. C++ can't give a struct and a
+   typedef of another type the same name, so there it is struct
+   lwp_scheduler */
+#ifdef __cplusplus
+#define LWP_SCHEDULER_TAG lwp_scheduler
+#else
+#define LWP_SCHEDULER_TAG scheduler
+#endif
+typedef struct LWP_SCHEDULER_TAG {
   void   (*init)(void);            /* initialize any structures     */
   void   (*shutdown)(void);        /* tear down any structures      */
-  void   (*admit)(thread new);     /* add a thread to the pool      */
+  void   (*admit)(thread t);       /* add a thread to the pool      */
   void   (*remove)(thread victim); /* remove a thread from the pool */
   thread (*next)(void);            /* select a thread to schedule   */
 } *scheduler;
 
+/* stack pool counters */
+typedef struct lwp_poolstats {
+  unsigned long hits;           /* stacks reused from the pool     */
+  unsigned long misses;         /* stacks that had to be mmap()ed  */
+  unsigned long pooled;         /* stacks sitting in the pool now  */
+  unsigned long trims;          /* pooled stacks madvise()d away   */
+} lwp_poolstats;
+
+/* library wide snapshot, see lwp_global_stats() */
+typedef struct lwp_globalstats {
+  unsigned long threads;        /* live threads                    */
+  unsigned long runnable;       /* live threads that aren't parked */
+  unsigned long parked;         /* blocked on something            */
+  unsigned long zombies;        /* exited, not yet waited for      */
+  unsigned long timers;         /* parked with a deadline          */
+  unsigned long io_waiting;     /* parked on a file descriptor     */
+} lwp_globalstats;
+
 /* lwp functions */
 extern tid_t lwp_create(lwpfun,void *,size_t);
+extern tid_t lwp_create_inplace(lwpfun f, size_t size, lwpinit init,
+                                void *ctx, size_t len);
+extern tid_t lwp_create_stackless(lwpstep step, void *arg);
+extern int   lwp_step_park(void);
+extern int   lwp_unpark(tid_t tid);
+extern int   lwp_step_join(tid_t tid, int *status, void (*fn)(void *),
+                           void *ctx);
 extern void  lwp_exit(int status);
 extern tid_t lwp_gettid(void);
 extern void  lwp_yield(void);
+extern int   lwp_yield_to(tid_t tid);
 extern void  lwp_start(void);
 extern void  lwp_stop(void);
 extern tid_t lwp_wait(int *);
+extern tid_t lwp_join(tid_t tid, int *status);
+extern tid_t lwp_join_with(tid_t tid, int *status, void (*fn)(void *),
+                           void *ctx);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
+extern int   lwp_set_handoff_hook(scheduler sched, void (*hook)(thread t));
 extern thread tid2thread(tid_t tid);
+extern void  lwp_set_stackpool(unsigned int cap);
+extern void  lwp_set_stackguard(int on);
+extern int   lwp_set_fpu(tid_t tid, int on);
+extern int   lwp_set_priority(tid_t tid, unsigned int prio);
+extern int   lwp_get_priority(tid_t tid);
+extern int   lwp_set_weight(tid_t tid, unsigned int weight);
+extern int   lwp_set_workers(unsigned int n);
+extern int   lwp_set_preempt(unsigned long quantum_ns);
+extern void  lwp_preempt_disable(void);
+extern void  lwp_preempt_enable(void);
+extern void  lwp_stackpool_stats(lwp_poolstats *stats);
+extern void  lwp_sleep_ns(unsigned long ns);
+extern int   lwp_stats(tid_t tid, lwp_threadstats *stats);
+extern void  lwp_global_stats(lwp_globalstats *stats);
+extern int   lwp_trace_start(unsigned int nevents);
+extern void  lwp_trace_stop(void);
+extern int   lwp_trace_dump(const char *path);
+extern int   lwp_key_create(lwp_key *key, void (*destructor)(void *));
+extern int   lwp_key_delete(lwp_key key);
+extern int   lwp_setspecific(lwp_key key, const void *value);
+extern void  *lwp_getspecific(lwp_key key);
+
+extern void  lwp_mutex_init(lwp_mutex *m);
+extern void  lwp_mutex_lock(lwp_mutex *m);
+extern int   lwp_mutex_trylock(lwp_mutex *m);
+extern int   lwp_mutex_timedlock(lwp_mutex *m, unsigned long timeout_ns);
+extern void  lwp_mutex_unlock(lwp_mutex *m);
+extern void  lwp_cond_init(lwp_cond *c);
+extern void  lwp_cond_wait(lwp_cond *c, lwp_mutex *m);
+extern int   lwp_cond_timedwait(lwp_cond *c, lwp_mutex *m,
+                                unsigned long timeout_ns);
+extern void  lwp_cond_signal(lwp_cond *c);
+extern void  lwp_cond_broadcast(lwp_cond *c);
+extern void  lwp_sem_init(lwp_sem *sem, unsigned int value);
+extern void  lwp_sem_wait(lwp_sem *sem);
+extern int   lwp_sem_trywait(lwp_sem *sem);
+extern int   lwp_sem_timedwait(lwp_sem *sem, unsigned long timeout_ns);
+extern void  lwp_sem_post(lwp_sem *sem);
+
+extern lwp_chan *lwp_chan_create(unsigned int cap);
+extern void  lwp_chan_close(lwp_chan *c);
+extern void  lwp_chan_destroy(lwp_chan *c);
+extern int   lwp_chan_send(lwp_chan *c, void *msg);
+extern int   lwp_chan_recv(lwp_chan *c, void **msg);
+extern int   lwp_chan_select(lwp_chan_op *ops, int n, int block);
+extern int   lwp_chan_timedselect(lwp_chan_op *ops, int n,
+                                  unsigned long timeout_ns);
+
+extern lwp_pool *lwp_pool_create(unsigned int n);
+extern int   lwp_pool_submit(lwp_pool *p, lwp_task *task, lwpfun fn,
+                             void *arg);
+extern int   lwp_task_wait(lwp_task *task);
+extern void  lwp_pool_destroy(lwp_pool *p);
+extern void  lwp_spawn(lwp_task *task, lwpfun fn, void *arg);
+extern void  lwp_sync(void);
+
+/* lwp_accept()'s addrlen is a socklen_t, which is an unsigned int on
+   Linux, so including lwp.h doesn't pull in <sys/socket.h> */
+struct sockaddr;
+
+extern ssize_t lwp_read(int fd, void *buf, size_t count);
+extern ssize_t lwp_write(int fd, const void *buf, size_t count);
+extern int   lwp_accept(int fd, struct sockaddr *addr, unsigned int *addrlen);
+extern int   lwp_poll(int fd, short events);
+extern int   lwp_timedpoll(int fd, short events, unsigned long timeout_ns);
+extern int   lwp_close(int fd);
 
 /* for lwp_wait */
 #define TERMOFFSET        8
@@ -96,5 +318,10 @@ extern thread tid2thread(tid_t tid);
 
 /* prototypes for asm functions */
 void swap_rfiles(rfile *, rfile *to);
+void swap_lean(rfile *, rfile *to);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
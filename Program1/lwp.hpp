@@ -0,0 +1,557 @@
+#ifndef LWPHPP
+#define LWPHPP
+/*
+ * lwp.hpp - C++17 interface to the lightweight process library
+ * Author: Kyle Jennings
+ *
+ * lwp::spawn() runs any callable on a new LWP. The callable is moved (or
+ * copied) straight onto the top of the new thread's stack by
+ * lwp_create_inplace(), so nothing is allocated for it, and the thread
+ * starts in a single template thunk that calls it. The join_handle it
+ * returns joins the thread when it goes out of scope, like std::jthread,
+ * and join() hands back the callable's result by value.
+ *
+ * As with std::thread, an exception that escapes the callable, or a copy
+ * of it that throws, ends the program, and join() throws std::system_error
+ * if the thread can't be joined (it was never made, or somebody else
+ * already reaped it).
+ *
+ * Compiled as C++20 it also has lwp::task<T>, a lazy coroutine. lwp::go()
+ * runs one as a stackless LWP (see lwp_create_stackless()), so it sits in
+ * the active scheduler's run queue beside ordinary LWPs and costs a
+ * context and its coroutine frame instead of a stack. Inside it,
+ * co_await lwp::reschedule() is lwp_yield(), co_await on another task runs
+ * that task to completion in the same LWP, and co_await on a join_handle
+ * parks until that thread is done. Nothing in a task may block the LWP
+ * way (lwp_sem_wait(), join(), ...), since there is no stack to block on.
+ */
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <optional>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include "lwp.h"
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#endif
+
+namespace lwp {
+
+namespace detail {
+
+/* where a thread leaves its result. It stays on the dead thread's stack
+   until the joiner moves it out from lwp_join_with() */
+template<class R>
+struct result_slot {
+    std::optional<R> result;
+};
+
+template<>
+struct result_slot<void> {
+};
+
+/* what sits at the top of the new thread's stack */
+template<class F, class R>
+struct frame : result_slot<R> {
+    F fn;
+
+    template<class G>
+    explicit frame(G &&g) : fn(std::forward<G>(g))
+    {
+    }
+};
+
+template<class F, class R>
+int thunk(void *where) noexcept
+{
+    auto *fr = static_cast<frame<F, R> *>(where);
+
+    if constexpr (std::is_void_v<R>)
+    {
+        std::invoke(std::move(fr->fn));
+        fr->~frame();
+    }
+    else
+    {
+        fr->result.emplace(std::invoke(std::move(fr->fn)));
+        fr->fn.~F();
+    }
+    return 0;
+}
+
+/* a join that reaped nothing, as std::thread::join() reports it */
+[[noreturn]] inline void join_failed(tid_t tid)
+{
+    throw std::system_error(std::make_error_code(tid == NO_THREAD ?
+        std::errc::invalid_argument : std::errc::no_such_process),
+        "lwp::join_handle::join");
+}
+
+/* lwp_join_with()'s ctx: what the dead thread left, and where its
+   result goes */
+template<class R>
+struct take_ctx {
+    void             *where;
+    std::optional<R> out;
+};
+
+template<>
+struct take_ctx<void> {
+    void *where;
+};
+
+/* lwp_join_with()'s fn: moves the result off the dead thread's stack */
+template<class R>
+void take(void *ctx) noexcept
+{
+    auto *c = static_cast<take_ctx<R> *>(ctx);
+    auto *slot = static_cast<result_slot<R> *>(c->where);
+
+    c->out.emplace(std::move(*slot->result));
+    slot->result.~optional();
+}
+
+/* lwp_create_inplace()'s ctx: the callable to build from, and where the
+   frame ended up */
+struct build_ctx {
+    void *src;
+    void *where;
+};
+
+template<class F, class R, class G>
+void build(void *where, void *ctx) noexcept
+{
+    auto *c = static_cast<build_ctx *>(ctx);
+
+    c->where = where;
+    new (where) frame<F, R>(std::forward<G>(
+        *static_cast<std::remove_reference_t<G> *>(c->src)));
+}
+
+} // namespace detail
+
+/**
+ * @brief Owns a thread started by lwp::spawn() (or lwp::go()). Joins it
+ *  on destruction if nobody has yet.
+ */
+template<class R>
+class join_handle {
+public:
+    join_handle() noexcept = default;
+
+    /* take, if any, collects the result from where when the thread is
+       reaped */
+    join_handle(tid_t tid, void *where, void (*take)(void *)) noexcept
+        : tid_(tid), where_(where), take_(take)
+    {
+    }
+
+    join_handle(join_handle &&other) noexcept
+        : tid_(std::exchange(other.tid_, NO_THREAD)),
+          where_(std::exchange(other.where_, nullptr)),
+          take_(std::exchange(other.take_, nullptr))
+    {
+    }
+
+    /* joins what this held first, so it throws as join() does */
+    join_handle &operator=(join_handle &&other)
+    {
+        if(this != &other)
+        {
+            if(joinable())
+                join();
+            tid_ = std::exchange(other.tid_, NO_THREAD);
+            where_ = std::exchange(other.where_, nullptr);
+            take_ = std::exchange(other.take_, nullptr);
+        }
+        return *this;
+    }
+
+    join_handle(const join_handle &) = delete;
+    join_handle &operator=(const join_handle &) = delete;
+
+    ~join_handle()
+    {
+        if(joinable())
+            join();
+    }
+
+    bool joinable() const noexcept
+    {
+        return tid_ != NO_THREAD;
+    }
+
+#ifdef __cpp_impl_coroutine
+    /* co_await from an lwp::task: join() without blocking */
+    auto operator co_await() && noexcept;
+#endif
+
+    tid_t get_id() const noexcept
+    {
+        return tid_;
+    }
+
+    /**
+     * @brief Waits for the thread to finish and reaps it
+     *
+     * @return R what the callable returned
+     * @throws std::system_error if there is no such thread to join
+     */
+    R join()
+    {
+        detail::take_ctx<R> c = {where_};
+        tid_t tid = std::exchange(tid_, NO_THREAD);
+
+        if(lwp_join_with(tid, nullptr, take_, &c) == NO_THREAD)
+            detail::join_failed(tid);
+        if constexpr (!std::is_void_v<R>)
+            return std::move(*c.out);
+    }
+
+private:
+    tid_t   tid_ = NO_THREAD;
+    void    *where_ = nullptr;
+    void    (*take_)(void *) = nullptr;
+};
+
+template<class F>
+using spawn_result_t = std::decay_t<std::invoke_result_t<std::decay_t<F> &&>>;
+
+/**
+ * @brief Runs f() on a new LWP
+ *
+ * @param f any callable taking no arguments
+ * @param len size of the stack in words, or 0 for the RLIMIT_STACK size
+ * @return join_handle for the thread, not joinable if it couldn't be made
+ */
+template<class F>
+join_handle<spawn_result_t<F>> spawn(F &&f, std::size_t len = 0)
+{
+    using Fn = std::decay_t<F>;
+    using R = spawn_result_t<F>;
+    using Frame = detail::frame<Fn, R>;
+
+    static_assert(alignof(Frame) <= 16, "over-aligned closures don't fit");
+
+    detail::build_ctx ctx = {
+        const_cast<void *>(static_cast<const void *>(std::addressof(f))),
+        nullptr
+    };
+    tid_t tid = lwp_create_inplace(detail::thunk<Fn, R>, sizeof(Frame),
+                                   detail::build<Fn, R, F &&>, &ctx, len);
+
+    void (*take)(void *) = nullptr;
+
+    if constexpr (!std::is_void_v<R>)
+        take = detail::take<R>;
+    return join_handle<R>(tid, ctx.where, take);
+}
+
+inline void yield()
+{
+    lwp_yield();
+}
+
+inline tid_t this_id()
+{
+    return lwp_gettid();
+}
+
+#ifdef __cpp_impl_coroutine
+
+template<class T = void>
+class task;
+
+namespace detail {
+
+/* an awaiter whose coroutine can't go on until a condition holds. The
+   step retries it instead of resuming, in case the LWP is woken early */
+struct parked {
+    virtual bool ready() noexcept = 0;
+};
+
+/* what every task's promise has. The outermost task of an LWP (top) is
+   what its steps resume: next is where it left off, or empty once the
+   task is done */
+struct promise_base {
+    std::coroutine_handle<> continuation;   /* task awaiting this one */
+    promise_base            *top = nullptr;
+    std::coroutine_handle<> next;
+    parked                  *wait = nullptr;
+    std::exception_ptr      error;
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        error = std::current_exception();
+    }
+};
+
+template<class T>
+struct promise_result : promise_base {
+    std::optional<T> result;
+
+    template<class U>
+    void return_value(U &&value)
+    {
+        result.emplace(std::forward<U>(value));
+    }
+};
+
+template<>
+struct promise_result<void> : promise_base {
+    void return_void() noexcept
+    {
+    }
+};
+
+/* at the end of a task, go back to whoever awaited it, or back out to the
+   step if nobody did */
+struct final_awaiter {
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    template<class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        if(h.promise().continuation)
+            return h.promise().continuation;
+        return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept
+    {
+    }
+};
+
+/* the step of a stackless LWP running a task */
+inline int co_step(void *arg) noexcept
+{
+    auto *top = static_cast<promise_base *>(arg);
+
+    if(top->wait && !top->wait->ready())
+        return LWP_STEP_AGAIN;
+    top->wait = nullptr;
+
+    std::exchange(top->next, {}).resume();
+    if(top->next)
+        return LWP_STEP_AGAIN;
+
+    /* as with lwp::spawn(), nobody is there to catch it */
+    if(top->error)
+        std::terminate();
+    return 0;
+}
+
+/* join_handle's take for a task: the result is in its promise, and the
+   frame outlives the LWP until it is collected */
+template<class T>
+void co_take(void *ctx) noexcept
+{
+    auto *c = static_cast<take_ctx<T> *>(ctx);
+    auto h = std::coroutine_handle<typename task<T>::promise_type>::from_address(
+        c->where);
+
+    if constexpr (!std::is_void_v<T>)
+        c->out.emplace(std::move(*h.promise().result));
+    h.destroy();
+}
+
+template<class R>
+struct join_awaiter : parked {
+    tid_t       tid;
+    void        (*take)(void *);
+    take_ctx<R> c;
+    int         res = 1;    /* lwp_step_join()'s last answer */
+
+    join_awaiter(tid_t t, void *where, void (*fn)(void *)) noexcept
+        : tid(t), take(fn), c{where}
+    {
+    }
+
+    bool ready() noexcept override
+    {
+        return (res = lwp_step_join(tid, nullptr, take, &c)) != 1;
+    }
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    template<class P>
+    bool await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        promise_base *top = h.promise().top;
+
+        if(ready())
+            return false;
+        top->next = h;
+        top->wait = this;
+        return true;
+    }
+
+    /* a failed join throws into the task, like join() */
+    R await_resume()
+    {
+        if(res < 0)
+            join_failed(tid);
+        if constexpr (!std::is_void_v<R>)
+            return std::move(*c.out);
+    }
+};
+
+struct reschedule_awaiter {
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    template<class P>
+    void await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        h.promise().top->next = h;
+    }
+
+    void await_resume() noexcept
+    {
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief A lazy coroutine returning T. It starts when it is co_awaited,
+ *  running in the awaiting task's LWP, or when lwp::go() gives it one.
+ */
+template<class T>
+class task {
+public:
+    struct promise_type : detail::promise_result<T> {
+        task get_return_object() noexcept
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        detail::final_awaiter final_suspend() noexcept
+        {
+            return {};
+        }
+    };
+
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {}))
+    {
+    }
+
+    task &operator=(task &&other) noexcept
+    {
+        if(this != &other)
+        {
+            if(h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task()
+    {
+        if(h_)
+            h_.destroy();
+    }
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    /* run it here: the awaiting task picks up again when it finishes */
+    template<class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        h_.promise().continuation = h;
+        h_.promise().top = h.promise().top;
+        return h_;
+    }
+
+    T await_resume()
+    {
+        if(h_.promise().error)
+            std::rethrow_exception(h_.promise().error);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*h_.promise().result);
+    }
+
+    std::coroutine_handle<promise_type> release() noexcept
+    {
+        return std::exchange(h_, {});
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h)
+    {
+    }
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+/**
+ * @brief Runs a task as a new stackless LWP
+ *
+ * @param t the task, not started yet
+ * @return join_handle for the LWP, not joinable if it couldn't be made
+ */
+template<class T>
+join_handle<T> go(task<T> t)
+{
+    auto h = t.release();
+    auto &p = h.promise();
+    tid_t tid;
+
+    p.top = &p;
+    p.next = h;
+    tid = lwp_create_stackless(detail::co_step,
+                               static_cast<detail::promise_base *>(&p));
+    if(tid == NO_THREAD)
+    {
+        h.destroy();
+        return {};
+    }
+    return join_handle<T>(tid, h.address(), detail::co_take<T>);
+}
+
+/**
+ * @brief co_await lwp::reschedule() in a task is lwp_yield()
+ */
+inline detail::reschedule_awaiter reschedule() noexcept
+{
+    return {};
+}
+
+template<class R>
+auto join_handle<R>::operator co_await() && noexcept
+{
+    return detail::join_awaiter<R>(std::exchange(tid_, NO_THREAD),
+                                   std::exchange(where_, nullptr),
+                                   std::exchange(take_, nullptr));
+}
+
+#endif
+
+} // namespace lwp
+
+#endif
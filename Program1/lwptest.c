@@ -0,0 +1,990 @@
+/*
+ * lwptest.c - Functional tests for the library. Each test checks results,
+ * not just that nothing crashed. Run with the number of workers as the
+ * argument (default 1); exits non-zero if anything failed.
+ * Author: Kyle Jennings
+ */
+
+#include <fenv.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <x86intrin.h>
+#include <xmmintrin.h>
+#include "lwp.h"
+#include "schedulers.h"
+
+#define NTHREADS    8
+#define POOLSTACK   3000            /* words, a size no other test uses */
+#define SMALLSTACK  4096            /* words */
+#define NINCS       2000            /* per thread, in the mutex test */
+#define NMSGS       1000            /* per sender, in the channel tests */
+#define NROUNDS     50              /* yields per thread in a test */
+#define SPIN_LIMIT  4000000000UL    /* TSC cycles a spinner gives up after */
+#define SPIN        200000UL        /* TSC cycles of work per turn */
+#define NTURNS      300             /* turns in the FairShare tests */
+#define TIMEOUT     20000000UL      /* ns for the timed waits */
+#define NCHURN      256             /* threads per round in the churn test */
+#define NTASKS      100
+
+#define CHECK(cond) \
+    do { if(!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond); \
+        __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED); } } while(0)
+
+static int failures;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* burns n cycles without a library call */
+static void spin(unsigned long n)
+{
+    unsigned long t = __rdtsc();
+
+    while(__rdtsc() - t < n)
+        ;
+}
+
+/******************************************************************************/
+/* Thread ids */
+
+static int nothing(void *arg)
+{
+    return 0;
+}
+
+static void test_tids(void)
+{
+    tid_t tids[NTHREADS], tid;
+    int i;
+
+    CHECK(tid2thread(lwp_gettid()) != NULL);
+    CHECK(tid2thread(lwp_gettid())->tid == lwp_gettid());
+    CHECK(tid2thread(NO_THREAD) == NULL);
+
+    for(i = 0; i < NTHREADS; i++)
+    {
+        tids[i] = lwp_create(nothing, NULL, SMALLSTACK);
+        CHECK(tids[i] != NO_THREAD && tid2thread(tids[i]) != NULL);
+        CHECK(tid2thread(tids[i])->tid == tids[i]);
+    }
+    for(i = 0; i < NTHREADS; i++)
+        CHECK(lwp_wait(NULL) != NO_THREAD);
+
+    /* a reaped thread's tid stays dead once its slot has a new owner */
+    tid = lwp_create(nothing, NULL, SMALLSTACK);
+    for(i = 0; i < NTHREADS; i++)
+        CHECK(tid2thread(tids[i]) == NULL && tids[i] != tid);
+    CHECK(lwp_wait(NULL) == tid);
+}
+
+/******************************************************************************/
+/* Create, exit, wait and join */
+
+/* yields arg times, so threads exit in a different order than they were
+   made and get unlinked from the middle of the lists */
+static int ret_arg(void *arg)
+{
+    long i;
+
+    for(i = 0; i < (long) arg; i++)
+        lwp_yield();
+    return (int) (long) arg;
+}
+
+static void test_wait_join(void)
+{
+    int i, status, sum = 0;
+    tid_t tid;
+
+    for(i = 1; i <= NTHREADS; i++)
+        CHECK(lwp_create(ret_arg, (void *) (long) (NTHREADS + 1 - i),
+                         SMALLSTACK) != NO_THREAD);
+    for(i = 1; i <= NTHREADS; i++)
+    {
+        tid = lwp_wait(&status);
+        CHECK(tid != NO_THREAD && LWPTERMINATED(status));
+        sum += LWPTERMSTAT(status);
+    }
+    CHECK(sum == NTHREADS * (NTHREADS + 1) / 2);
+    CHECK(lwp_wait(&status) == NO_THREAD);
+
+    tid = lwp_create(ret_arg, (void *) 42L, SMALLSTACK);
+    CHECK(lwp_join(tid, &status) == tid && LWPTERMSTAT(status) == 42);
+    CHECK(lwp_join(tid, &status) == NO_THREAD);
+    CHECK(lwp_join(lwp_gettid(), &status) == NO_THREAD);
+}
+
+/******************************************************************************/
+/* Stack pool */
+
+/* one create and reap at len words, and what the pool made of it */
+static void pool_cycle(size_t len, lwp_poolstats *stats)
+{
+    CHECK(lwp_create(nothing, NULL, len) != NO_THREAD);
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    lwp_stackpool_stats(stats);
+}
+
+static void test_stackpool(void)
+{
+    lwp_poolstats before, after;
+
+    pool_cycle(POOLSTACK, &before);
+    pool_cycle(POOLSTACK, &after);
+    CHECK(after.hits == before.hits + 1);
+    CHECK(after.misses == before.misses);
+    CHECK(after.pooled == before.pooled);
+
+    /* stacks are pooled by size */
+    pool_cycle(2 * POOLSTACK, &after);
+    CHECK(after.misses == before.misses + 1);
+
+    /* a cap of zero empties the pool and turns it off */
+    lwp_set_stackpool(0);
+    lwp_stackpool_stats(&before);
+    CHECK(before.pooled == 0);
+    pool_cycle(POOLSTACK, &after);
+    CHECK(after.misses == before.misses + 1 && after.pooled == 0);
+    lwp_set_stackpool(64);
+}
+
+/******************************************************************************/
+/* Stack sizes and guard pages */
+
+static int poke_base(void *arg)
+{
+    *(volatile unsigned long *) tid2thread(lwp_gettid())->stack = 0;
+    return 0;
+}
+
+/* whether writing to the lowest word of a new stack faults, found out in
+   a child so the fault doesn't take the tests with it */
+static int base_faults(void)
+{
+    int status;
+    pid_t pid;
+
+    if( (pid = fork()) == 0 )
+    {
+        lwp_create(poke_base, NULL, POOLSTACK);
+        lwp_wait(NULL);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+/* the same, once a stack of the same size made with the guard the other
+   way is in the pool. POOLSTACK words and a guard page take as much as
+   POOLSTACK words and a page's worth more */
+static int pooled_base_faults(int guard)
+{
+    size_t page = sysconf(_SC_PAGE_SIZE) / sizeof(unsigned long);
+    int status;
+    pid_t pid;
+
+    if( (pid = fork()) == 0 )
+    {
+        lwp_set_stackguard(!guard);
+        lwp_create(nothing, NULL, guard ? POOLSTACK + page : POOLSTACK);
+        lwp_wait(NULL);
+        lwp_set_stackguard(guard);
+        lwp_create(poke_base, NULL, guard ? POOLSTACK : POOLSTACK + page);
+        lwp_wait(NULL);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+static void test_stacks(void)
+{
+    size_t bytes = SMALLSTACK * sizeof(unsigned long);
+    thread t;
+    tid_t tid;
+
+    /* len is in words, rounded up to a page, guard included */
+    tid = lwp_create(nothing, NULL, SMALLSTACK);
+    CHECK( (t = tid2thread(tid)) != NULL );
+    CHECK(t->stacksize >= bytes && t->stacksize <= bytes + 2 * 4096);
+    lwp_wait(NULL);
+
+    CHECK(base_faults());
+    lwp_set_stackguard(FALSE);
+    CHECK(!base_faults());
+    lwp_set_stackguard(TRUE);
+
+    /* a pooled stack only goes to a request with the same guard setting */
+    CHECK(pooled_base_faults(TRUE));
+    CHECK(!pooled_base_faults(FALSE));
+}
+
+/******************************************************************************/
+/* FPU control words */
+
+/* keeps its own rounding mode in both the x87 and SSE control words
+   across switches, some of them with an LWP_FPU thread */
+static int round_keeper(void *arg)
+{
+    int mode = (int) (long) arg, i, ok = TRUE;
+
+    fesetround(mode);
+    for(i = 0; i < NROUNDS; i++)
+    {
+        lwp_yield();
+        ok &= fegetround() == mode;
+        ok &= (_mm_getcsr() & _MM_ROUND_MASK) == (unsigned int) mode << 3;
+    }
+    return ok;
+}
+
+static void test_fpu(void)
+{
+    static const int modes[] = {FE_UPWARD, FE_DOWNWARD, FE_TOWARDZERO};
+    int i, status;
+    tid_t tid;
+
+    /* the middle one switches in and out with the full register file, and
+       the others both ways, depending on who they meet */
+    for(i = 0; i < 3; i++)
+    {
+        tid = lwp_create(round_keeper, (void *) (long) modes[i], SMALLSTACK);
+        if(i == 1)
+            CHECK(lwp_set_fpu(tid, TRUE) == 0);
+    }
+    for(i = 0; i < 3; i++)
+    {
+        CHECK(lwp_wait(&status) != NO_THREAD);
+        CHECK(LWPTERMSTAT(status) == TRUE);
+    }
+    CHECK(fegetround() == FE_TONEAREST);
+    CHECK(lwp_set_fpu(NO_THREAD, TRUE) < 0);
+}
+
+/******************************************************************************/
+/* Preemption */
+
+static volatile int spinning[2];
+
+/* spins until the other one has run too, which without preemption it
+   never would */
+static int spinner(void *arg)
+{
+    long me = (long) arg;
+    unsigned long start = __rdtsc();
+
+    spinning[me] = TRUE;
+    while(!spinning[!me] && __rdtsc() - start < SPIN_LIMIT)
+        ;
+    return spinning[!me];
+}
+
+static void test_preempt(void)
+{
+    int i, status;
+
+    spinning[0] = spinning[1] = FALSE;
+    CHECK(lwp_set_preempt(1000000) == 0);
+    for(i = 0; i < 2; i++)
+        lwp_create(spinner, (void *) (long) i, SMALLSTACK);
+    for(i = 0; i < 2; i++)
+    {
+        CHECK(lwp_wait(&status) != NO_THREAD);
+        CHECK(LWPTERMSTAT(status) == TRUE);
+    }
+    CHECK(lwp_set_preempt(0) == 0);
+}
+
+/******************************************************************************/
+/* Priority scheduler */
+
+static int order[3], norder;
+
+static int record(void *arg)
+{
+    order[norder++] = (int) (long) arg;
+    return 0;
+}
+
+static void test_priority(void)
+{
+    static const unsigned int prios[] = {40, 10, 20};
+    scheduler old = lwp_get_scheduler();
+    int i;
+
+    /* the caller goes last so it doesn't starve the 40 */
+    lwp_set_scheduler(Priority);
+    CHECK(lwp_set_priority(lwp_gettid(), LWP_PRIO_LEVELS - 1) == 0);
+    norder = 0;
+    for(i = 0; i < 3; i++)
+        CHECK(lwp_set_priority(lwp_create(record, (void *) (long) prios[i],
+                                          SMALLSTACK), prios[i]) == 0);
+    CHECK(lwp_get_priority(lwp_gettid()) == LWP_PRIO_LEVELS - 1);
+    for(i = 0; i < 3; i++)
+        lwp_wait(NULL);
+    CHECK(norder == 3);
+    CHECK(order[0] == 10 && order[1] == 20 && order[2] == 40);
+    lwp_set_priority(lwp_gettid(), LWP_PRIO_DEFAULT);
+    lwp_set_scheduler(old);
+}
+
+/******************************************************************************/
+/* Fair-share scheduler */
+
+static volatile int weighing;
+static unsigned long turns[2];
+
+static int weighted(void *arg)
+{
+    long me = (long) arg;
+
+    while(weighing)
+    {
+        spin(SPIN);
+        turns[me]++;
+        lwp_yield();
+    }
+    return 0;
+}
+
+/* twice the weight gets about twice the turns */
+static void test_fairshare(void)
+{
+    scheduler old = lwp_get_scheduler();
+    tid_t heavy;
+    int i;
+
+    lwp_set_scheduler(FairShare);
+    weighing = TRUE;
+    turns[0] = turns[1] = 0;
+    heavy = lwp_create(weighted, (void *) 0L, SMALLSTACK);
+    CHECK(lwp_set_weight(heavy, 2 * LWP_WEIGHT_DEFAULT) == 0);
+    lwp_create(weighted, (void *) 1L, SMALLSTACK);
+    while(turns[0] + turns[1] < NTURNS)
+        lwp_yield();
+    weighing = FALSE;
+    for(i = 0; i < 2; i++)
+        lwp_wait(NULL);
+    lwp_set_scheduler(old);
+    CHECK(turns[0] * 2 > turns[1] * 3);
+    CHECK(turns[0] < turns[1] * 3);
+}
+
+/******************************************************************************/
+/* Mutexes, condition variables and semaphores */
+
+static lwp_mutex mtx;
+static lwp_cond cnd;
+static lwp_sem sem_items, sem_slots;
+static long counter;
+static int ready;
+
+static int incr(void *arg)
+{
+    int i;
+
+    for(i = 0; i < NINCS; i++)
+    {
+        lwp_mutex_lock(&mtx);
+        counter++;
+        if(i % 64 == 0)
+            lwp_yield();
+        lwp_mutex_unlock(&mtx);
+    }
+    return 0;
+}
+
+static int cond_waiter(void *arg)
+{
+    lwp_mutex_lock(&mtx);
+    while(!ready)
+        lwp_cond_wait(&cnd, &mtx);
+    counter++;
+    lwp_mutex_unlock(&mtx);
+    return 0;
+}
+
+static int producer(void *arg)
+{
+    long i;
+
+    for(i = 1; i <= NMSGS; i++)
+    {
+        lwp_sem_wait(&sem_slots);
+        lwp_mutex_lock(&mtx);
+        counter += i;
+        lwp_mutex_unlock(&mtx);
+        lwp_sem_post(&sem_items);
+    }
+    return 0;
+}
+
+static void test_sync(void)
+{
+    tid_t tids[NTHREADS];
+    long sum = 0, i;
+
+    lwp_mutex_init(&mtx);
+    counter = 0;
+    for(i = 0; i < NTHREADS; i++)
+        tids[i] = lwp_create(incr, NULL, SMALLSTACK);
+    for(i = 0; i < NTHREADS; i++)
+        lwp_join(tids[i], NULL);
+    CHECK(counter == NTHREADS * NINCS);
+
+    lwp_mutex_lock(&mtx);
+    CHECK(lwp_mutex_trylock(&mtx) < 0);
+    lwp_mutex_unlock(&mtx);
+    CHECK(lwp_mutex_trylock(&mtx) == 0);
+    lwp_mutex_unlock(&mtx);
+
+    /* everyone parked on the condition gets out on a broadcast */
+    lwp_cond_init(&cnd);
+    counter = 0;
+    ready = FALSE;
+    for(i = 0; i < NTHREADS; i++)
+        tids[i] = lwp_create(cond_waiter, NULL, SMALLSTACK);
+    for(i = 0; i < 10; i++)
+        lwp_yield();
+    lwp_mutex_lock(&mtx);
+    ready = TRUE;
+    lwp_cond_broadcast(&cnd);
+    lwp_mutex_unlock(&mtx);
+    for(i = 0; i < NTHREADS; i++)
+        lwp_join(tids[i], NULL);
+    CHECK(counter == NTHREADS);
+
+    /* bounded buffer of 4 slots; every unit produced is consumed */
+    lwp_sem_init(&sem_items, 0);
+    lwp_sem_init(&sem_slots, 4);
+    counter = 0;
+    tids[0] = lwp_create(producer, NULL, SMALLSTACK);
+    for(i = 0; i < NMSGS; i++)
+    {
+        lwp_sem_wait(&sem_items);
+        lwp_sem_post(&sem_slots);
+        sum++;
+    }
+    lwp_join(tids[0], NULL);
+    CHECK(sum == NMSGS && counter == (long) NMSGS * (NMSGS + 1) / 2);
+    CHECK(lwp_sem_trywait(&sem_items) < 0);
+}
+
+/******************************************************************************/
+/* Channels */
+
+static int sender(void *arg)
+{
+    lwp_chan *c = arg;
+    long i;
+
+    for(i = 1; i <= NMSGS; i++)
+        if(lwp_chan_send(c, (void *) i) < 0)
+            return 1;
+    return 0;
+}
+
+static int closer(void *arg)
+{
+    sender(arg);
+    lwp_chan_close(arg);
+    return 0;
+}
+
+static void test_chan(void)
+{
+    lwp_chan *chan_a, *chan_b;
+    lwp_chan_op ops[2];
+    tid_t t1, t2;
+    void *msg;
+    long sum = 0;
+    int i, status;
+
+    /* unbuffered, two senders */
+    chan_a = lwp_chan_create(0);
+    t1 = lwp_create(sender, chan_a, SMALLSTACK);
+    t2 = lwp_create(sender, chan_a, SMALLSTACK);
+    for(i = 0; i < 2 * NMSGS; i++)
+    {
+        CHECK(lwp_chan_recv(chan_a, &msg) == 0);
+        sum += (long) msg;
+    }
+    lwp_join(t1, &status);
+    CHECK(LWPTERMSTAT(status) == 0);
+    lwp_join(t2, &status);
+    CHECK(LWPTERMSTAT(status) == 0);
+    CHECK(sum == (long) NMSGS * (NMSGS + 1));
+
+    /* select over an unbuffered and a buffered channel until one closes,
+       then drain the other: a closed channel hands out its buffer first */
+    chan_b = lwp_chan_create(16);
+    t1 = lwp_create(closer, chan_a, SMALLSTACK);
+    t2 = lwp_create(closer, chan_b, SMALLSTACK);
+    ops[0].chan = chan_a;
+    ops[1].chan = chan_b;
+    ops[0].send = ops[1].send = FALSE;
+    sum = 0;
+    for(;;)
+    {
+        i = lwp_chan_select(ops, 2, TRUE);
+        CHECK(i == 0 || i == 1);
+        if(ops[i].result < 0)
+            break;
+        sum += (long) ops[i].msg;
+    }
+    while(lwp_chan_recv(ops[!i].chan, &msg) == 0)
+        sum += (long) msg;
+    CHECK(lwp_chan_recv(ops[i].chan, &msg) < 0);
+    lwp_join(t1, NULL);
+    lwp_join(t2, NULL);
+    CHECK(sum == (long) NMSGS * (NMSGS + 1));
+    CHECK(lwp_chan_send(chan_b, NULL) < 0);
+
+    lwp_chan_destroy(chan_a);
+    lwp_chan_destroy(chan_b);
+}
+
+/******************************************************************************/
+/* File descriptors */
+
+static int pfd[2];
+
+static int reader(void *arg)
+{
+    char buf[16];
+    ssize_t n, total = 0;
+
+    while(total < 10 && (n = lwp_read(pfd[0], buf, sizeof(buf))) > 0)
+        total += n;
+    return total;
+}
+
+static void test_io(void)
+{
+    int i, status;
+    tid_t tid;
+
+    /* the reader parks on the empty pipe in between the writes */
+    CHECK(pipe(pfd) == 0);
+    tid = lwp_create(reader, NULL, SMALLSTACK);
+    for(i = 0; i < 10; i++)
+        lwp_yield();
+    CHECK(lwp_write(pfd[1], "01234", 5) == 5);
+    for(i = 0; i < 10; i++)
+        lwp_yield();
+    CHECK(lwp_write(pfd[1], "56789", 5) == 5);
+    CHECK(lwp_join(tid, &status) == tid && LWPTERMSTAT(status) == 10);
+
+    CHECK(lwp_poll(pfd[1], POLLOUT) & POLLOUT);
+    CHECK(lwp_timedpoll(pfd[0], POLLIN, TIMEOUT) == 0);
+    lwp_close(pfd[0]);
+    lwp_close(pfd[1]);
+}
+
+/******************************************************************************/
+/* Timers and timed waits */
+
+static int holder(void *arg)
+{
+    lwp_mutex_lock(&mtx);
+    lwp_sleep_ns(3 * TIMEOUT);
+    lwp_mutex_unlock(&mtx);
+    return 0;
+}
+
+static void test_timers(void)
+{
+    lwp_chan *chan;
+    lwp_chan_op op;
+    unsigned long start;
+    tid_t tid;
+
+    start = now_ns();
+    lwp_sleep_ns(TIMEOUT);
+    CHECK(now_ns() - start >= TIMEOUT);
+
+    lwp_sem_init(&sem_items, 0);
+    start = now_ns();
+    CHECK(lwp_sem_timedwait(&sem_items, TIMEOUT) < 0);
+    CHECK(now_ns() - start >= TIMEOUT);
+    lwp_sem_post(&sem_items);
+    CHECK(lwp_sem_timedwait(&sem_items, TIMEOUT) == 0);
+
+    lwp_mutex_init(&mtx);
+    lwp_cond_init(&cnd);
+    lwp_mutex_lock(&mtx);
+    start = now_ns();
+    CHECK(lwp_cond_timedwait(&cnd, &mtx, TIMEOUT) < 0);
+    CHECK(now_ns() - start >= TIMEOUT);
+    lwp_mutex_unlock(&mtx);
+
+    tid = lwp_create(holder, NULL, SMALLSTACK);
+    while(lwp_mutex_trylock(&mtx) == 0)
+    {
+        lwp_mutex_unlock(&mtx);
+        lwp_yield();
+    }
+    start = now_ns();
+    CHECK(lwp_mutex_timedlock(&mtx, TIMEOUT) < 0);
+    CHECK(now_ns() - start >= TIMEOUT);
+    lwp_join(tid, NULL);
+    CHECK(lwp_mutex_timedlock(&mtx, TIMEOUT) == 0);
+    lwp_mutex_unlock(&mtx);
+
+    chan = lwp_chan_create(0);
+    op.chan = chan;
+    op.send = FALSE;
+    start = now_ns();
+    CHECK(lwp_chan_timedselect(&op, 1, TIMEOUT) < 0);
+    CHECK(now_ns() - start >= TIMEOUT);
+    lwp_chan_destroy(chan);
+}
+
+/******************************************************************************/
+/* Statistics */
+
+static volatile int yielded;
+
+static int yielder(void *arg)
+{
+    int i;
+
+    for(i = 0; i < NROUNDS; i++)
+        lwp_yield();
+    yielded = TRUE;
+    return 0;
+}
+
+static void test_stats(unsigned int workers)
+{
+    lwp_threadstats st;
+    lwp_globalstats gs;
+    tid_t tid;
+
+    yielded = FALSE;
+    tid = lwp_create(yielder, NULL, SMALLSTACK);
+    lwp_global_stats(&gs);
+    CHECK(gs.threads >= 2 && gs.runnable >= 2);
+    while(!yielded)
+        lwp_yield();
+
+    /* a zombie keeps its counters until it is reaped */
+    CHECK(lwp_stats(tid, &st) == 0);
+    CHECK(st.switches_in > 0 && st.cycles > 0);
+    if(workers == 1)
+        CHECK(st.voluntary >= NROUNDS && st.involuntary == 0);
+    CHECK(lwp_join(tid, NULL) == tid);
+    CHECK(lwp_stats(tid, &st) < 0);
+}
+
+/******************************************************************************/
+/* Event trace */
+
+static void test_trace(void)
+{
+    char path[] = "/tmp/lwptestXXXXXX", buf[64];
+    FILE *f;
+    tid_t tid;
+    int fd;
+
+    CHECK( (fd = mkstemp(path)) >= 0 );
+    close(fd);
+
+    CHECK(lwp_trace_start(1024) == 0);
+    tid = lwp_create(ret_arg, (void *) 3L, SMALLSTACK);
+    CHECK(lwp_join(tid, NULL) == tid);
+    lwp_trace_stop();
+
+    /* at least the create, the switches and the exit */
+    CHECK(lwp_trace_dump(path) >= 3);
+    CHECK( (f = fopen(path, "r")) != NULL );
+    if(f)
+    {
+        CHECK(fgets(buf, sizeof(buf), f) && strstr(buf, "traceEvents"));
+        fclose(f);
+    }
+    unlink(path);
+}
+
+/******************************************************************************/
+/* LWP-local storage */
+
+static lwp_key key;
+static int dtor_calls;
+
+static void dtor(void *value)
+{
+    __atomic_fetch_add(&dtor_calls, (int) (long) value, __ATOMIC_RELAXED);
+}
+
+static int key_user(void *arg)
+{
+    CHECK(lwp_getspecific(key) == NULL);
+    lwp_setspecific(key, arg);
+    lwp_yield();
+    return lwp_getspecific(key) == arg;
+}
+
+static void test_keys(void)
+{
+    tid_t tids[NTHREADS];
+    int i, status, ok = 0;
+
+    CHECK(lwp_key_create(&key, dtor) == 0);
+    dtor_calls = 0;
+    for(i = 0; i < NTHREADS; i++)
+        tids[i] = lwp_create(key_user, (void *) (long) (i + 1), SMALLSTACK);
+    for(i = 0; i < NTHREADS; i++)
+    {
+        lwp_join(tids[i], &status);
+        ok += LWPTERMSTAT(status);
+    }
+    CHECK(ok == NTHREADS);
+    CHECK(dtor_calls == NTHREADS * (NTHREADS + 1) / 2);
+    CHECK(lwp_getspecific(key) == NULL);
+    CHECK(lwp_key_delete(key) == 0);
+}
+
+/******************************************************************************/
+/* Context churn */
+
+/* contexts go back on the free list and come off it again, FPU ones with
+   their XSAVE area */
+static void test_churn(void)
+{
+    lwp_globalstats before, after;
+    tid_t tids[NCHURN];
+    int round, i, status, sum;
+
+    lwp_global_stats(&before);
+    for(round = 0; round < 3; round++)
+    {
+        for(i = 0; i < NCHURN; i++)
+        {
+            tids[i] = lwp_create(ret_arg, (void *) (long) (i % 3), SMALLSTACK);
+            CHECK(tids[i] != NO_THREAD);
+            if(i % 2)
+                CHECK(lwp_set_fpu(tids[i], TRUE) == 0);
+        }
+        for(i = sum = 0; i < NCHURN; i++)
+        {
+            CHECK(lwp_join(tids[i], &status) == tids[i]);
+            sum += LWPTERMSTAT(status);
+        }
+        CHECK(sum == NCHURN / 3 * 3 + (NCHURN % 3 == 2));
+    }
+    lwp_global_stats(&after);
+    CHECK(after.threads == before.threads);
+}
+
+/******************************************************************************/
+/* Directed handoffs */
+
+static tid_t burner_tid;
+static volatile int handing_off;
+static unsigned long ran[2];    /* vruntime gained by giver, burner */
+
+static unsigned long my_vruntime(void)
+{
+    return tid2thread(lwp_gettid())->vruntime;
+}
+
+static int giver(void *arg)
+{
+    unsigned long start = my_vruntime();
+    int i;
+
+    for(i = 0; i < NROUNDS; i++)
+        CHECK(lwp_yield_to(burner_tid) == 0);
+    handing_off = FALSE;
+    ran[0] = my_vruntime() - start;
+    return 0;
+}
+
+static int burner(void *arg)
+{
+    unsigned long start = my_vruntime();
+
+    while(handing_off)
+    {
+        spin(SPIN);
+        lwp_yield();
+    }
+    ran[1] = my_vruntime() - start;
+    return 0;
+}
+
+/* the burner's turns come from the giver, and it is the burner that has
+   to pay for them */
+static void test_handoff(void)
+{
+    scheduler old = lwp_get_scheduler();
+    tid_t tid;
+
+    CHECK(lwp_yield_to(lwp_gettid()) < 0);
+    CHECK(lwp_yield_to(NO_THREAD) < 0);
+
+    lwp_set_scheduler(FairShare);
+    handing_off = TRUE;
+    burner_tid = lwp_create(burner, NULL, SMALLSTACK);
+    tid = lwp_create(giver, NULL, SMALLSTACK);
+    lwp_join(tid, NULL);
+    lwp_join(burner_tid, NULL);
+    lwp_set_scheduler(old);
+    CHECK(ran[0] * 4 < ran[1]);
+    CHECK(ran[1] >= NROUNDS * SPIN);
+}
+
+/******************************************************************************/
+/* Worker pools */
+
+static int square(void *arg)
+{
+    long n = (long) arg;
+
+    lwp_yield();
+    return n * n;
+}
+
+static void test_pool(void)
+{
+    lwp_task tasks[NTASKS];
+    lwp_pool *p;
+    long i, sum = 0;
+
+    CHECK( (p = lwp_pool_create(4)) != NULL );
+    for(i = 0; i < NTASKS; i++)
+        CHECK(lwp_pool_submit(p, &tasks[i], square, (void *) i) == 0);
+    for(i = NTASKS - 1; i >= 0; i--)
+        sum += lwp_task_wait(&tasks[i]);
+    CHECK(sum == (long) (NTASKS - 1) * NTASKS * (2 * NTASKS - 1) / 6);
+    lwp_pool_destroy(p);
+}
+
+/******************************************************************************/
+/* Fork-join */
+
+static int fib(void *arg)
+{
+    long n = (long) arg;
+    lwp_task child;
+    int x;
+
+    if(n < 2)
+        return n;
+    lwp_spawn(&child, fib, (void *) (n - 1));
+    x = fib((void *) (n - 2));
+    lwp_sync();
+    return child.result + x;
+}
+
+static void test_spawn(void)
+{
+    lwp_task top;
+
+    lwp_spawn(&top, fib, (void *) 18L);
+    lwp_sync();
+    CHECK(top.result == 2584);
+}
+
+/******************************************************************************/
+/* Stackless threads */
+
+static int steps;
+
+static int stepper(void *arg)
+{
+    if(__atomic_add_fetch(&steps, 1, __ATOMIC_RELAXED) % 5)
+        return LWP_STEP_AGAIN;
+    return (int) (long) arg;
+}
+
+static int parker(void *arg)
+{
+    int *state = arg;
+
+    if((*state)++ == 0)
+    {
+        CHECK(lwp_step_park() == 0);
+        return LWP_STEP_AGAIN;
+    }
+    return 7;
+}
+
+static void test_stackless(void)
+{
+    lwp_threadstats st;
+    int status, state = 0;
+    tid_t tid;
+
+    steps = 0;
+    tid = lwp_create_stackless(stepper, (void *) 3L);
+    CHECK(lwp_join(tid, &status) == tid && LWPTERMSTAT(status) == 3);
+    CHECK(steps == 5);
+
+    tid = lwp_create_stackless(parker, &state);
+    while(state == 0)
+        lwp_yield();
+    lwp_yield();
+    CHECK(state == 1);
+    CHECK(lwp_stats(tid, &st) == 0);
+    CHECK(lwp_unpark(tid) == 0);
+    CHECK(lwp_join(tid, &status) == tid && LWPTERMSTAT(status) == 7);
+    CHECK(state == 2);
+    CHECK(lwp_step_park() < 0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n = argc > 1 ? atoi(argv[1]) : 1;
+
+    if(lwp_set_workers(n) < 0)
+    {
+        fprintf(stderr, "can't use %u workers\n", n);
+        return 1;
+    }
+    lwp_start();
+
+    test_tids();
+    test_wait_join();
+    test_stackpool();
+    if(n == 1)
+        test_stacks();
+    test_fpu();
+    if(n == 1)
+    {
+        test_preempt();
+        test_priority();
+        test_fairshare();
+    }
+    test_sync();
+    test_chan();
+    test_io();
+    test_timers();
+    test_stats(n);
+    test_trace();
+    test_keys();
+    test_churn();
+    if(n == 1)
+        test_handoff();
+    test_pool();
+    test_spawn();
+    test_stackless();
+
+    printf("%s with %u worker%s\n", failures ? "FAILED" : "passed", n,
+           n == 1 ? "" : "s");
+    lwp_exit(failures != 0);
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * lwptest_hpp.cpp - Functional tests for lwp.hpp: lwp::spawn() closures
+ * and lwp::task coroutines. Built as C++20 so both halves of the header
+ * are covered. Run with the number of workers as the argument (default
+ * 1); exits non-zero if anything failed.
+ * Author: Kyle Jennings
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "lwp.hpp"
+
+#define NSPAWNS     100
+#define NLEAVES     10
+#define SMALLSTACK  4096        /* words */
+
+#define CHECK(cond) \
+    do { if(!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond); \
+        __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED); } } while(0)
+
+static int failures;
+
+/* what join() threw, or 0 if it returned */
+template<class R>
+static int join_errno(lwp::join_handle<R> &h)
+{
+    try
+    {
+        h.join();
+    }
+    catch(const std::system_error &e)
+    {
+        return e.code().value();
+    }
+    return 0;
+}
+
+/******************************************************************************/
+/* Closures on a stack */
+
+struct counted {
+    int *dtors;
+
+    explicit counted(int *d) : dtors(d)
+    {
+    }
+    counted(counted &&o) noexcept : dtors(std::exchange(o.dtors, nullptr))
+    {
+    }
+    ~counted()
+    {
+        if(dtors)
+            ++*dtors;
+    }
+};
+
+static void test_spawn()
+{
+    std::vector<lwp::join_handle<int>> hs;
+    std::string s(100, 'x');
+    long sum = 0;
+    int i, dtors = 0, ran = 0;
+
+    auto str = lwp::spawn([s] {
+        lwp::yield();
+        return s + "!";
+    }, SMALLSTACK);
+    auto uniq = lwp::spawn([p = std::make_unique<int>(41)] {
+        return *p + 1;
+    }, SMALLSTACK);
+    for(i = 0; i < NSPAWNS; i++)
+        hs.push_back(lwp::spawn([i] {
+            lwp::yield();
+            return i * i;
+        }, SMALLSTACK));
+
+    for(auto &h : hs)
+        sum += h.join();
+    CHECK(sum == (long) (NSPAWNS - 1) * NSPAWNS * (2 * NSPAWNS - 1) / 6);
+    CHECK(str.join() == s + "!");
+    CHECK(uniq.join() == 42);
+    CHECK(!uniq.joinable());
+
+    /* the handle joins on the way out, and the closure is destroyed with
+       the thread */
+    {
+        auto h = lwp::spawn([c = counted(&dtors), &ran] {
+            lwp::yield();
+            ran = 1;
+        }, SMALLSTACK);
+    }
+    CHECK(ran == 1);
+    CHECK(dtors == 1);
+}
+
+static void test_join_fails()
+{
+    lwp::join_handle<int> none;
+    int status;
+
+    /* never made */
+    CHECK(join_errno(none) == EINVAL);
+
+    /* reaped behind the handle's back */
+    auto h = lwp::spawn([] { return 1; }, SMALLSTACK);
+    CHECK(lwp_join(h.get_id(), &status) == h.get_id());
+    CHECK(join_errno(h) == ESRCH);
+    CHECK(!h.joinable());
+
+    /* assigning over a handle joins what it held, and throws the same way */
+    auto g = lwp::spawn([] { return 2; }, SMALLSTACK);
+    CHECK(lwp_join(g.get_id(), &status) == g.get_id());
+    try
+    {
+        g = lwp::spawn([] { return 3; }, SMALLSTACK);
+        CHECK(!"assignment over a reaped thread didn't throw");
+    }
+    catch(const std::system_error &e)
+    {
+        CHECK(e.code().value() == ESRCH);
+    }
+    CHECK(!g.joinable());
+}
+
+/******************************************************************************/
+/* Coroutines */
+
+static lwp::task<int> leaf(int x)
+{
+    co_await lwp::reschedule();
+    co_return x * 2;
+}
+
+static lwp::task<int> mid(int n)
+{
+    int i, s = 0;
+
+    for(i = 0; i < n; i++)
+        s += co_await leaf(i);
+    co_return s;
+}
+
+static lwp::task<void> boom()
+{
+    co_await lwp::reschedule();
+    throw std::runtime_error("boom");
+}
+
+static lwp::task<std::string> catcher()
+{
+    try
+    {
+        co_await boom();
+    }
+    catch(const std::exception &e)
+    {
+        co_return e.what();
+    }
+    co_return "";
+}
+
+/* waits on a task LWP and a stack LWP without blocking */
+static lwp::task<long> fan()
+{
+    std::vector<lwp::join_handle<int>> hs;
+    long s = 0;
+    int i;
+
+    for(i = 0; i < NLEAVES; i++)
+        hs.push_back(lwp::go(leaf(i)));
+    for(auto &h : hs)
+        s += co_await std::move(h);
+    s += co_await lwp::spawn([] {
+        lwp::yield();
+        return 1000;
+    }, SMALLSTACK);
+    co_return s;
+}
+
+/* a failed co_await join throws into the task */
+static lwp::task<int> await_nothing()
+{
+    lwp::join_handle<int> none;
+
+    try
+    {
+        co_await std::move(none);
+    }
+    catch(const std::system_error &e)
+    {
+        co_return e.code().value();
+    }
+    co_return 0;
+}
+
+static void test_tasks()
+{
+    CHECK(lwp::go(mid(NLEAVES)).join() == NLEAVES * (NLEAVES - 1));
+    CHECK(lwp::go(catcher()).join() == "boom");
+    CHECK(lwp::go(fan()).join() == NLEAVES * (NLEAVES - 1) + 1000);
+    CHECK(lwp::go(await_nothing()).join() == EINVAL);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n = argc > 1 ? atoi(argv[1]) : 1;
+
+    if(lwp_set_workers(n) < 0)
+    {
+        fprintf(stderr, "can't use %u workers\n", n);
+        return 1;
+    }
+    lwp_start();
+
+    test_spawn();
+    test_join_fails();
+    test_tasks();
+
+    printf("%s with %u worker%s\n", failures ? "FAILED" : "passed", n,
+           n == 1 ? "" : "s");
+    lwp_exit(failures != 0);
+    return 0;
+}
@@ -6,4 +6,6 @@ extern scheduler AlwaysZero;
 extern scheduler ChangeOnSIGTSTP;
 extern scheduler ChooseHighestColor;
 extern scheduler ChooseLowestColor;
+extern scheduler Priority;
+extern scheduler FairShare;
 #endif